@@ -6,6 +6,7 @@
 */
 
 #include <assert.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,16 +23,57 @@
 #define LUASQL_ENVIRONMENT_PG "PostgreSQL environment"
 #define LUASQL_CONNECTION_PG "PostgreSQL connection"
 #define LUASQL_CURSOR_PG "PostgreSQL cursor"
+#define LUASQL_STATEMENT_PG "PostgreSQL statement"
+
+/* whether a result of a streaming query holds rows */
+#ifdef LIBPQ_HAS_CHUNK_MODE
+#define stream_rows(s) ((s) == PGRES_SINGLE_TUPLE || (s) == PGRES_TUPLES_CHUNK)
+#else
+#define stream_rows(s) ((s) == PGRES_SINGLE_TUPLE)
+#endif
+
+/* bytes of COPY data gathered before they are sent or handed to Lua */
+#define LUASQL_PG_COPY_BUFFER 65536
+
+/* microseconds between the PostgreSQL and the Unix epochs */
+#define LUASQL_PG_EPOCH 946684800000000.0
+
+/* decoders of the values of binary results */
+enum {
+	DEC_RAW,                       /* length-exact string */
+	DEC_BOOL,
+	DEC_INT,                       /* int2, int4 or int8 */
+	DEC_OID,                       /* unsigned 32 bits */
+	DEC_FLOAT4,
+	DEC_FLOAT8,
+	DEC_NUMERIC,
+	DEC_UUID,
+	DEC_TIMESTAMP,                 /* seconds since the Unix epoch */
+	DEC_DATE
+};
 
 typedef struct {
 	short      closed;
 } env_data;
 
 
+/* name of a collected statement, deallocated when the connection is used */
+typedef struct stmt_name {
+	struct stmt_name *next;
+	char       name[1];
+} stmt_name;
+
+
 typedef struct {
 	short      closed;
 	int        env;                /* reference to environment */
 	int        auto_commit;        /* 0 for manual commit */
+	short      streaming;          /* 1 while a streaming cursor is open */
+	short      copying;            /* 1 while a COPY is in progress */
+	short      binary;             /* 1 to request binary results */
+	int        types;              /* reference to table of type names or LUA_NOREF */
+	unsigned int stmt_counter;     /* number of unnamed statements prepared */
+	stmt_name *deferred;           /* statements waiting to be deallocated */
 	PGconn    *pg_conn;
 } conn_data;
 
@@ -39,13 +81,33 @@ typedef struct {
 typedef struct {
 	short      closed;
 	int        conn;               /* reference to connection */
+	conn_data *conn_data;
+	short      stream;             /* 1 while rows are still arriving */
 	int        numcols;            /* number of columns */
 	int        colnames, coltypes; /* reference to column information tables */
 	int        curr_tuple;         /* next tuple to be read */
 	PGresult  *pg_res;
+	unsigned char *decoders;       /* decoder of each column or NULL */
 } cur_data;
 
 
+typedef struct {
+	short      closed;
+	int        conn;               /* reference to connection */
+	conn_data *conn_data;
+	char      *name;               /* name of the prepared statement */
+	int        nparams;            /* number of parameters */
+	int        params;             /* reference to bound values or LUA_NOREF */
+} stmt_data;
+
+
+/* buffer of COPY data */
+typedef struct {
+	char      *data;
+	size_t     len, size;
+} copy_buffer;
+
+
 typedef void (*creator) (lua_State *L, cur_data *cur);
 
 
@@ -71,6 +133,18 @@ static conn_data *getconnection (lua_State *L) {
 }
 
 
+/*
+** Check for valid statement.
+*/
+static stmt_data *getstatement (lua_State *L) {
+	stmt_data *stmt = (stmt_data *)luaL_checkudata (L, 1, LUASQL_STATEMENT_PG);
+	luaL_argcheck (L, stmt != NULL, 1, LUASQL_PREFIX"statement expected");
+	luaL_argcheck (L, !stmt->closed, 1, LUASQL_PREFIX"statement is closed");
+	luaL_argcheck (L, !stmt->conn_data->closed, 1, LUASQL_PREFIX"connection is closed");
+	return stmt;
+}
+
+
 /*
 ** Check for valid cursor.
 */
@@ -82,23 +156,231 @@ static cur_data *getcursor (lua_State *L) {
 }
 
 
+/*
+** Return the decoder of the binary values of the given type.
+*/
+static unsigned char type_decoder (Oid type) {
+	switch (type) {
+		case 16:   /* bool */
+			return DEC_BOOL;
+		case 20:   /* int8 */
+		case 21:   /* int2 */
+		case 23:   /* int4 */
+			return DEC_INT;
+		case 26:   /* oid */
+			return DEC_OID;
+		case 700:  /* float4 */
+			return DEC_FLOAT4;
+		case 701:  /* float8 */
+			return DEC_FLOAT8;
+		case 1700: /* numeric */
+			return DEC_NUMERIC;
+		case 2950: /* uuid */
+			return DEC_UUID;
+		case 1114: /* timestamp */
+		case 1184: /* timestamptz */
+			return DEC_TIMESTAMP;
+		case 1082: /* date */
+			return DEC_DATE;
+		default:   /* bytea, text types and the rest */
+			return DEC_RAW;
+	}
+}
+
+
+/*
+** Read a big-endian integer of n bytes.
+*/
+static unsigned long long get_be (const unsigned char *p, int n) {
+	unsigned long long v = 0;
+	int i;
+	for (i = 0; i < n; i++)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+
+/*
+** Push a signed integer, as a Lua integer if available.
+*/
+static void push_int (lua_State *L, long long v) {
+#if LUA_VERSION_NUM >= 503
+	lua_pushinteger (L, (lua_Integer)v);
+#else
+	lua_pushnumber (L, (lua_Number)v);
+#endif
+}
+
+
+/*
+** Push the value of a numeric in binary format: the number of base
+** 10000 digits, the weight of the first one, the sign and the scale,
+** followed by the digits, all 16 bits wide.
+*/
+static void push_numeric (lua_State *L, const unsigned char *p, int len) {
+	int ndigits, weight, sign, i;
+	double v = 0, zero = 0;
+	if (len < 8) {
+		lua_pushnil (L);
+		return;
+	}
+	ndigits = (int)get_be (p, 2);
+	weight = (short)get_be (p + 2, 2);
+	sign = (int)get_be (p + 4, 2);
+	if (sign == 0xC000) {  /* NaN */
+		lua_pushnumber (L, (lua_Number)(zero / zero));
+		return;
+	}
+	if (sign == 0xD000 || sign == 0xF000) {  /* infinity and -infinity */
+		lua_pushnumber (L, (lua_Number)(sign == 0xD000 ? HUGE_VAL : -HUGE_VAL));
+		return;
+	}
+	for (i = 0; i < ndigits && 8 + 2*i + 2 <= len; i++)
+		v = v * 10000 + (double)get_be (p + 8 + 2*i, 2);
+	v *= pow (10000.0, weight - ndigits + 1);
+	lua_pushnumber (L, (lua_Number)(sign == 0x4000 ? -v : v));
+}
+
+
+/*
+** Push a binary value with the given decoder.
+*/
+static void push_binary (lua_State *L, unsigned char decoder, const char *value, int len) {
+	const unsigned char *p = (const unsigned char *)value;
+	switch (decoder) {
+		case DEC_BOOL:
+			lua_pushboolean (L, len > 0 && p[0] != 0);
+			return;
+		case DEC_INT:
+			if (len == 2)
+				push_int (L, (short)get_be (p, 2));
+			else if (len == 4)
+				push_int (L, (int)get_be (p, 4));
+			else if (len == 8)
+				push_int (L, (long long)get_be (p, 8));
+			else
+				break;
+			return;
+		case DEC_OID:
+			if (len == 4) {
+				push_int (L, (long long)get_be (p, 4));
+				return;
+			}
+			break;
+		case DEC_FLOAT4:
+			if (len == 4) {
+				unsigned int bits = (unsigned int)get_be (p, 4);
+				float f;
+				memcpy (&f, &bits, sizeof (f));
+				lua_pushnumber (L, (lua_Number)f);
+				return;
+			}
+			break;
+		case DEC_FLOAT8:
+			if (len == 8) {
+				unsigned long long bits = get_be (p, 8);
+				double d;
+				memcpy (&d, &bits, sizeof (d));
+				lua_pushnumber (L, (lua_Number)d);
+				return;
+			}
+			break;
+		case DEC_NUMERIC:
+			push_numeric (L, p, len);
+			return;
+		case DEC_UUID:
+			if (len == 16) {
+				char buff[37];
+				int i, j = 0;
+				for (i = 0; i < 16; i++) {
+					if (i == 4 || i == 6 || i == 8 || i == 10)
+						buff[j++] = '-';
+					sprintf (buff + j, "%02x", p[i]);
+					j += 2;
+				}
+				lua_pushlstring (L, buff, 36);
+				return;
+			}
+			break;
+		case DEC_TIMESTAMP:
+			if (len == 8) {
+				long long us = (long long)get_be (p, 8);
+				/* the extreme values are infinity and -infinity */
+				if (us == 0x7FFFFFFFFFFFFFFFLL)
+					lua_pushnumber (L, (lua_Number)HUGE_VAL);
+				else if (us == (-0x7FFFFFFFFFFFFFFFLL - 1))
+					lua_pushnumber (L, (lua_Number)-HUGE_VAL);
+				else
+					lua_pushnumber (L, (lua_Number)((us + LUASQL_PG_EPOCH) / 1e6));
+				return;
+			}
+			break;
+		case DEC_DATE:
+			if (len == 4) {
+				int days = (int)get_be (p, 4);
+				/* the extreme values are infinity and -infinity */
+				if (days == 0x7FFFFFFF)
+					lua_pushnumber (L, (lua_Number)HUGE_VAL);
+				else if (days == (-0x7FFFFFFF - 1))
+					lua_pushnumber (L, (lua_Number)-HUGE_VAL);
+				else
+					lua_pushnumber (L, (lua_Number)(days * 86400.0 + LUASQL_PG_EPOCH / 1e6));
+				return;
+			}
+			break;
+	}
+	lua_pushlstring (L, value, len);
+}
+
+
 /*
 ** Push the value of #i field of #tuple row.
 */
-static void pushvalue (lua_State *L, PGresult *res, int tuple, int i) {
+static void pushvalue (lua_State *L, cur_data *cur, int tuple, int i) {
+	PGresult *res = cur->pg_res;
 	if (PQgetisnull (res, tuple, i-1))
 		lua_pushnil (L);
+	else if (cur->decoders != NULL)
+		push_binary (L, cur->decoders[i-1], PQgetvalue (res, tuple, i-1),
+			PQgetlength (res, tuple, i-1));
 	else
 		lua_pushstring (L, PQgetvalue (res, tuple, i-1));
 }
 
 
+/*
+** Discard the remaining results of a streaming query, cancelling it
+** first if requested and the connection is in autocommit mode (inside
+** a transaction, the rows are read instead, since the cancel would
+** abort it).
+*/
+static void stream_finish (cur_data *cur, int cancel) {
+	PGconn *pg_conn = cur->conn_data->pg_conn;
+	PGresult *res;
+	if (!cur->stream)
+		return;
+	if (cancel && cur->conn_data->auto_commit) {
+		PGcancel *pg_cancel = PQgetCancel (pg_conn);
+		char errbuf[256];
+		if (pg_cancel != NULL) {
+			PQcancel (pg_cancel, errbuf, sizeof (errbuf));
+			PQfreeCancel (pg_cancel);
+		}
+	}
+	while ((res = PQgetResult (pg_conn)) != NULL)
+		PQclear (res);
+	cur->stream = 0;
+	cur->conn_data->streaming = 0;
+}
+
+
 /*
 ** Closes the cursor and nullify all structure fields.
 */
 static void cur_nullify (lua_State *L, cur_data *cur) {
 	/* Nullify structure fields. */
 	cur->closed = 1;
+	stream_finish (cur, 1);
 	PQclear(cur->pg_res);
 	luaL_unref (L, LUA_REGISTRYINDEX, cur->conn);
 	luaL_unref (L, LUA_REGISTRYINDEX, cur->colnames);
@@ -114,7 +396,27 @@ static int cur_fetch (lua_State *L) {
 	PGresult *res = cur->pg_res;
 	int tuple = cur->curr_tuple;
 
-	if (tuple >= PQntuples(cur->pg_res)) {
+	while (tuple >= PQntuples(res)) {
+		if (cur->stream) {
+			/* get the next rows of a streaming query */
+			PGresult *next = PQgetResult (cur->conn_data->pg_conn);
+			ExecStatusType status = PQresultStatus (next);
+			if (next != NULL && stream_rows (status)) {
+				PQclear (cur->pg_res);
+				res = cur->pg_res = next;
+				tuple = cur->curr_tuple = 0;
+				continue;
+			}
+			if (next != NULL && status != PGRES_TUPLES_OK) {
+				lua_pushstring (L, PQresultErrorMessage (next));
+				PQclear (next);
+				stream_finish (cur, 0);
+				cur_nullify (L, cur);
+				return luasql_failmsg (L, "error fetching result. PostgreSQL: ", lua_tostring (L, -1));
+			}
+			PQclear (next);
+			stream_finish (cur, 0);
+		}
 		cur_nullify (L, cur);
 		lua_pushnil(L);  /* no more results */
 		return 1;
@@ -127,14 +429,14 @@ static int cur_fetch (lua_State *L) {
 		if (strchr (opts, 'n') != NULL)
 			/* Copy values to numerical indices */
 			for (i = 1; i <= cur->numcols; i++) {
-				pushvalue (L, res, tuple, i);
+				pushvalue (L, cur, tuple, i);
 				lua_rawseti (L, 2, i);
 			}
 		if (strchr (opts, 'a') != NULL)
 			/* Copy values to alphanumerical indices */
 			for (i = 1; i <= cur->numcols; i++) {
 				lua_pushstring (L, PQfname (res, i-1));
-				pushvalue (L, res, tuple, i);
+				pushvalue (L, cur, tuple, i);
 				lua_rawset (L, 2);
 			}
 		lua_pushvalue(L, 2);
@@ -144,7 +446,7 @@ static int cur_fetch (lua_State *L) {
 		int i;
 		luaL_checkstack (L, cur->numcols, LUASQL_PREFIX"too many columns");
 		for (i = 1; i <= cur->numcols; i++)
-			pushvalue (L, res, tuple, i);
+			pushvalue (L, cur, tuple, i);
 		return cur->numcols; /* return #numcols values */
 	}
 }
@@ -181,29 +483,87 @@ static int cur_close (lua_State *L) {
 
 
 /*
-** Get the internal database type of the given column.
+** Add the type names of the rows of res (oid, typname) to the table on
+** top of the stack.
 */
-static char *getcolumntype (PGconn *conn, PGresult *result, int i, char *buff) {
-	Oid codigo = PQftype (result, i);
-	char stmt[100];
-	PGresult *res;
+static void add_types (lua_State *L, PGresult *res) {
+	int i;
+	for (i = 0; i < PQntuples (res); i++) {
+		lua_pushnumber (L, strtod (PQgetvalue (res, i, 0), NULL));
+		lua_pushstring (L, PQgetvalue (res, i, 1));
+		lua_rawset (L, -3);
+	}
+}
 
-	sprintf (stmt, "select typname from pg_type where oid = %d", codigo);
-	res = PQexec(conn, stmt);
-	strcpy (buff, "undefined");
 
-	if (PQresultStatus (res) == PGRES_TUPLES_OK) {
-		if (PQntuples(res) > 0) {
-			char *name = PQgetvalue(res, 0, 0);
-			if (strcmp (name, "bpchar")==0 || strcmp (name, "varchar")==0) {
-				int modifier = PQfmod (result, i) - 4;
-				sprintf (buff, "%.20s (%d)", name, modifier);
-			}
-			else
-				strncpy (buff, name, 20);
+/*
+** Fill the type name cache of the connection with all types of the
+** database, in a single query.
+** Return 1 in case of success.
+*/
+static int load_types (lua_State *L, conn_data *conn) {
+	PGresult *res = PQexec (conn->pg_conn, "select oid, typname from pg_type");
+	if (PQresultStatus (res) != PGRES_TUPLES_OK) {
+		PQclear (res);
+		return 0;
+	}
+	lua_newtable (L);
+	add_types (L, res);
+	PQclear (res);
+	luaL_unref (L, LUA_REGISTRYINDEX, conn->types);
+	conn->types = luaL_ref (L, LUA_REGISTRYINDEX);
+	return 1;
+}
+
+
+/*
+** Push the name of the given type, from the cache of the connection,
+** which is loaded on first use; types created later are queried once.
+** Push nil if the name is unknown or can not be queried (while a
+** streaming cursor is open or a COPY is in progress).
+*/
+static void push_typename (lua_State *L, conn_data *conn, Oid type) {
+	int busy = conn->streaming || conn->copying;
+	if (conn->types == LUA_NOREF && (busy || !load_types (L, conn))) {
+		lua_pushnil (L);
+		return;
+	}
+	lua_rawgeti (L, LUA_REGISTRYINDEX, conn->types);
+	lua_pushnumber (L, type);
+	lua_rawget (L, -2);
+	if (lua_isnil (L, -1) && !busy) {
+		char stmt[100];
+		PGresult *res;
+		sprintf (stmt, "select oid, typname from pg_type where oid = %u", type);
+		res = PQexec (conn->pg_conn, stmt);
+		if (PQresultStatus (res) == PGRES_TUPLES_OK) {
+			lua_pop (L, 1);
+			add_types (L, res);
+			lua_pushnumber (L, type);
+			lua_rawget (L, -2);
+		}
+		PQclear (res);
+	}
+	lua_remove (L, -2);
+}
+
+
+/*
+** Get the internal database type of the given column.
+*/
+static char *getcolumntype (lua_State *L, conn_data *conn, PGresult *result, int i, char *buff) {
+	strcpy (buff, "undefined");
+	push_typename (L, conn, PQftype (result, i));
+	if (lua_isstring (L, -1)) {
+		const char *name = lua_tostring (L, -1);
+		if (strcmp (name, "bpchar")==0 || strcmp (name, "varchar")==0) {
+			int modifier = PQfmod (result, i) - 4;
+			sprintf (buff, "%.20s (%d)", name, modifier);
 		}
+		else
+			sprintf (buff, "%.63s", name);
 	}
-	PQclear(res);
+	lua_pop (L, 1);
 	return buff;
 }
 
@@ -227,16 +587,11 @@ static void create_colnames (lua_State *L, cur_data *cur) {
 */
 static void create_coltypes (lua_State *L, cur_data *cur) {
 	PGresult *result = cur->pg_res;
-	conn_data *conn;
 	char typename[100];
 	int i;
-	lua_rawgeti (L, LUA_REGISTRYINDEX, cur->conn);
-	if (!lua_isuserdata (L, -1))
-		luaL_error (L, LUASQL_PREFIX"invalid connection");
-	conn = (conn_data *)lua_touserdata (L, -1);
 	lua_newtable (L);
 	for (i = 1; i <= cur->numcols; i++) {
-		lua_pushstring(L, getcolumntype (conn->pg_conn, result, i-1, typename));
+		lua_pushstring(L, getcolumntype (L, cur->conn_data, result, i-1, typename));
 		lua_rawseti (L, -2, i);
 	}
 }
@@ -283,7 +638,10 @@ static int cur_getcoltypes (lua_State *L) {
 ** Push the number of rows.
 */
 static int cur_numrows (lua_State *L) {
-	lua_pushnumber (L, PQntuples (getcursor(L)->pg_res));
+	cur_data *cur = getcursor (L);
+	if (cur->stream)
+		return luasql_faildirect (L, "number of rows of a streaming cursor is unknown");
+	lua_pushnumber (L, PQntuples (cur->pg_res));
 	return 1;
 }
 
@@ -292,17 +650,29 @@ static int cur_numrows (lua_State *L) {
 ** Create a new Cursor object and push it on top of the stack.
 */
 static int create_cursor (lua_State *L, int conn, PGresult *result) {
-	cur_data *cur = (cur_data *)lua_newuserdata(L, sizeof(cur_data));
+	int binary = PQbinaryTuples (result);
+	int numcols = PQnfields (result);
+	/* the decoders of binary results follow the structure */
+	cur_data *cur = (cur_data *)lua_newuserdata(L, sizeof(cur_data) + (binary ? numcols : 0));
+	int i;
 	luasql_setmeta (L, LUASQL_CURSOR_PG);
 
 	/* fill in structure */
 	cur->closed = 0;
 	cur->conn = LUA_NOREF;
+	cur->conn_data = (conn_data *)lua_touserdata (L, conn);
+	cur->stream = 0;
 	cur->numcols = PQnfields(result);
 	cur->colnames = LUA_NOREF;
 	cur->coltypes = LUA_NOREF;
 	cur->curr_tuple = 0;
 	cur->pg_res = result;
+	cur->decoders = NULL;
+	if (binary) {
+		cur->decoders = (unsigned char *)(cur + 1);
+		for (i = 0; i < numcols; i++)
+			cur->decoders[i] = type_decoder (PQftype (result, i));
+	}
 	lua_pushvalue (L, conn);
 	cur->conn = luaL_ref (L, LUA_REGISTRYINDEX);
 
@@ -325,6 +695,50 @@ static void sql_rollback(conn_data *conn) {
 }
 
 
+/*
+** Raise an error if the connection is busy with a streaming cursor
+** or a COPY.
+*/
+static void check_stream (lua_State *L, conn_data *conn) {
+	if (conn->streaming)
+		luaL_error (L, LUASQL_PREFIX"there is an open streaming cursor");
+	if (conn->copying)
+		luaL_error (L, LUASQL_PREFIX"there is a COPY in progress");
+}
+
+
+/*
+** Deallocate the statements collected since the connection was last
+** used. In an aborted transaction they would fail, so they wait for
+** its end.
+*/
+static void flush_deferred (conn_data *conn) {
+	if (PQtransactionStatus (conn->pg_conn) == PQTRANS_INERROR)
+		return;
+	while (conn->deferred != NULL) {
+		stmt_name *s = conn->deferred;
+		conn->deferred = s->next;
+#ifdef LIBPQ_HAS_CLOSE_PREPARED
+		PQclear (PQclosePrepared (conn->pg_conn, s->name));
+#else
+		{
+			char *ident = PQescapeIdentifier (conn->pg_conn, s->name, strlen (s->name));
+			if (ident != NULL) {
+				char *sql = (char *)malloc (strlen (ident) + 12);
+				if (sql != NULL) {
+					sprintf (sql, "DEALLOCATE %s", ident);
+					PQclear (PQexec (conn->pg_conn, sql));
+					free (sql);
+				}
+				PQfreemem (ident);
+			}
+		}
+#endif
+		free (s);
+	}
+}
+
+
 /*
 ** Connection object collector function
 */
@@ -334,6 +748,12 @@ static int conn_gc (lua_State *L) {
 		/* Nullify structure fields. */
 		conn->closed = 1;
 		luaL_unref (L, LUA_REGISTRYINDEX, conn->env);
+		luaL_unref (L, LUA_REGISTRYINDEX, conn->types);
+		while (conn->deferred != NULL) {
+			stmt_name *s = conn->deferred;
+			conn->deferred = s->next;
+			free (s);
+		}
 		PQfinish (conn->pg_conn);
 	}
 	return 0;
@@ -353,6 +773,8 @@ static int conn_close (lua_State *L) {
 		lua_pushboolean (L, 0);
 		return 1;
 	}
+	check_stream (L, conn);
+	flush_deferred (conn);
 	conn_gc (L);
 	lua_pushboolean (L, 1);
 	return 1;
@@ -403,14 +825,10 @@ static int conn_escape (lua_State *L) {
 
 
 /*
-** Execute an SQL statement.
-** Return a Cursor object if the statement is a query, otherwise
-** return the number of tuples affected by the statement.
+** Push the outcome of the result of a statement: a Cursor object if the
+** statement is a query, otherwise the number of tuples affected by it.
 */
-static int conn_execute (lua_State *L) {
-	conn_data *conn = getconnection (L);
-	const char *statement = luaL_checkstring (L, 2);
-	PGresult *res = PQexec(conn->pg_conn, statement);
+static int push_result (lua_State *L, int conn, PGresult *res) {
 	if (res && PQresultStatus(res)==PGRES_COMMAND_OK) {
 		/* no tuples returned */
 		lua_pushnumber(L, atof(PQcmdTuples(res)));
@@ -419,12 +837,529 @@ static int conn_execute (lua_State *L) {
 	}
 	else if (res && PQresultStatus(res)==PGRES_TUPLES_OK)
 		/* tuples returned */
-		return create_cursor (L, 1, res);
+		return create_cursor (L, conn, res);
 	else {
 		/* error */
+		conn_data *data = (conn_data *)lua_touserdata (L, conn);
 		PQclear (res);
+		return luasql_failmsg(L, "error executing statement. PostgreSQL: ", PQerrorMessage(data->pg_conn));
+	}
+}
+
+
+/*
+** Execute an SQL statement.
+** Return a Cursor object if the statement is a query, otherwise
+** return the number of tuples affected by the statement.
+*/
+static int conn_execute (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	const char *statement = luaL_checkstring (L, 2);
+	check_stream (L, conn);
+	flush_deferred (conn);
+	if (conn->binary)
+		return push_result (L, 1, PQexecParams(conn->pg_conn, statement,
+			0, NULL, NULL, NULL, NULL, 1));
+	return push_result (L, 1, PQexec(conn->pg_conn, statement));
+}
+
+
+/*
+** Execute an SQL statement, returning a cursor which receives the rows
+** of a query as they are fetched, one at a time or, if the library
+** supports it, in chunks of the given size, instead of all of them at
+** once. The connection can not be used until the cursor is closed.
+*/
+static int conn_stream (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	const char *statement = luaL_checkstring (L, 2);
+	int chunk = (int)luaL_optnumber (L, 3, 1);
+	PGresult *res, *next;
+	luaL_argcheck (L, chunk > 0, 3, LUASQL_PREFIX"invalid chunk size");
+	check_stream (L, conn);
+
+	if (!(conn->binary ? PQsendQueryParams (conn->pg_conn, statement, 0,
+			NULL, NULL, NULL, NULL, 1) : PQsendQuery (conn->pg_conn, statement)))
 		return luasql_failmsg(L, "error executing statement. PostgreSQL: ", PQerrorMessage(conn->pg_conn));
+#ifdef LIBPQ_HAS_CHUNK_MODE
+	if (chunk > 1)
+		PQsetChunkedRowsMode (conn->pg_conn, chunk);
+	else
+#endif
+		PQsetSingleRowMode (conn->pg_conn);
+
+	res = PQgetResult (conn->pg_conn);
+	if (res && stream_rows (PQresultStatus (res))) {
+		create_cursor (L, 1, res);
+		((cur_data *)lua_touserdata (L, -1))->stream = 1;
+		conn->streaming = 1;
+		return 1;
+	}
+	/* no rows: the statement has finished */
+	while ((next = PQgetResult (conn->pg_conn)) != NULL)
+		PQclear (next);
+	return push_result (L, 1, res);
+}
+
+
+/*
+** Format the number at the given index with all its digits: integers
+** (and integral floats) without exponent, other floats with 17 digits.
+*/
+static void format_number (lua_State *L, int i, char *buff) {
+	lua_Number n;
+#if LUA_VERSION_NUM >= 503
+	if (lua_isinteger (L, i)) {
+		sprintf (buff, LUA_INTEGER_FMT, (LUAI_UACINT)lua_tointeger (L, i));
+		return;
+	}
+#endif
+	n = lua_tonumber (L, i);
+	if (n == floor (n) && fabs (n) < 9.2e18)
+		sprintf (buff, "%.0f", (double)n);
+	else
+		sprintf (buff, "%.17g", (double)n);
+}
+
+
+/*
+** Convert the value at the given index to the text format of a
+** parameter, pushing it on the stack, and return it (NULL for nil).
+*/
+static const char *param_value (lua_State *L, int i) {
+	char buff[64];
+	switch (lua_type (L, i)) {
+		case LUA_TNIL:
+			lua_pushnil (L);
+			return NULL;
+		case LUA_TBOOLEAN:
+			lua_pushstring (L, lua_toboolean (L, i) ? "true" : "false");
+			break;
+		case LUA_TNUMBER:
+			format_number (L, i, buff);
+			lua_pushstring (L, buff);
+			break;
+		case LUA_TSTRING:
+			lua_pushvalue (L, i);
+			break;
+		default:
+			luaL_error (L, LUASQL_PREFIX"invalid value for parameter (%s)", luaL_typename (L, i));
+	}
+	return lua_tostring (L, -1);
+}
+
+
+/*
+** Push a table with the parameter values given from index first to the
+** top of the stack (or in the array part of a table, if it is the only
+** one), converted to text.
+*/
+static void params_table (lua_State *L, stmt_data *stmt, int first) {
+	int top = lua_gettop (L);
+	int from = first, i;
+	if (top == first && lua_istable (L, first)) {
+		from = 0;  /* values come from the table */
+		top = first + stmt->nparams - 1;
+	}
+	luaL_argcheck (L, top - first + 1 <= stmt->nparams, first,
+		LUASQL_PREFIX"too many parameters");
+	lua_newtable (L);
+	for (i = 0; i < stmt->nparams && first + i <= top; i++) {
+		if (from == 0)
+			lua_rawgeti (L, first, i + 1);
+		else
+			lua_pushvalue (L, from + i);
+		param_value (L, lua_gettop (L));
+		lua_rawseti (L, -3, i + 1);
+		lua_pop (L, 1);
+	}
+}
+
+
+/*
+** Prepare an SQL statement on the server, which then parses and plans
+** it only once. The optional name allows it to be executed by EXECUTE
+** commands too; otherwise a unique one is generated.
+** Return a Statement object.
+*/
+static int conn_prepare (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	const char *statement = luaL_checkstring (L, 2);
+	const char *name = luaL_optstring (L, 3, NULL);
+	char buff[32];
+	stmt_data *stmt;
+	PGresult *res;
+	int nparams;
+	check_stream (L, conn);
+
+	if (name == NULL) {
+		sprintf (buff, "luasql_%u", ++conn->stmt_counter);
+		name = buff;
+	}
+	res = PQprepare (conn->pg_conn, name, statement, 0, NULL);
+	if (PQresultStatus (res) == PGRES_COMMAND_OK) {
+		PQclear (res);
+		res = PQdescribePrepared (conn->pg_conn, name);
+	}
+	if (PQresultStatus (res) != PGRES_COMMAND_OK) {
+		PQclear (res);
+		return luasql_failmsg (L, "error preparing statement. PostgreSQL: ", PQerrorMessage (conn->pg_conn));
+	}
+	nparams = PQnparams (res);
+	PQclear (res);
+
+	stmt = (stmt_data *)lua_newuserdata (L, sizeof (stmt_data));
+	stmt->closed = 1;  /* until it is filled in */
+	stmt->name = NULL;
+	luasql_setmeta (L, LUASQL_STATEMENT_PG);
+	stmt->name = (char *)malloc (strlen (name) + 1);
+	if (stmt->name == NULL)
+		return luaL_error (L, LUASQL_PREFIX"out of memory");
+	strcpy (stmt->name, name);
+	stmt->closed = 0;
+	stmt->conn_data = conn;
+	stmt->nparams = nparams;
+	stmt->params = LUA_NOREF;
+	lua_pushvalue (L, 1);
+	stmt->conn = luaL_ref (L, LUA_REGISTRYINDEX);
+	return 1;
+}
+
+
+/*
+** Set whether the results of the connection are requested in binary
+** format, whose values are decoded to Lua values of their types.
+*/
+static int conn_setbinary (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	conn->binary = (short)lua_toboolean (L, 2);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Load (or reload) the type name cache of the connection, so column
+** types are found without further queries.
+*/
+static int conn_loadtypes (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	check_stream (L, conn);
+	if (!load_types (L, conn))
+		return luasql_failmsg (L, "error loading types. PostgreSQL: ", PQerrorMessage (conn->pg_conn));
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Return the message of the error object on top of the stack, raised
+** by a Lua function called during a COPY.
+*/
+static const char *copy_error (lua_State *L, const char *def) {
+	const char *msg = lua_tostring (L, -1);
+	return (msg != NULL) ? msg : def;
+}
+
+
+/*
+** Append len bytes to the buffer.
+** Return 0 if memory runs out.
+*/
+static int copy_add (copy_buffer *buf, const char *s, size_t len) {
+	if (buf->len + len > buf->size) {
+		size_t size = buf->size > 0 ? buf->size : LUASQL_PG_COPY_BUFFER;
+		char *data;
+		while (size < buf->len + len)
+			size *= 2;
+		data = (char *)realloc (buf->data, size);
+		if (data == NULL)
+			return 0;
+		buf->data = data;
+		buf->size = size;
+	}
+	memcpy (buf->data + buf->len, s, len);
+	buf->len += len;
+	return 1;
+}
+
+
+/*
+** Append the value at the given index in COPY text format, escaping
+** the backslash and the characters which separate columns and rows.
+** Return NULL or an error message.
+*/
+static const char *copy_value (lua_State *L, copy_buffer *buf, int i) {
+	const char *s;
+	size_t len, j, start;
+	switch (lua_type (L, i)) {
+		case LUA_TNIL:
+			return copy_add (buf, "\\N", 2) ? NULL : "out of memory";
+		case LUA_TBOOLEAN:
+			return copy_add (buf, lua_toboolean (L, i) ? "t" : "f", 1) ? NULL : "out of memory";
+		case LUA_TNUMBER: {
+			char num[64];
+			format_number (L, i, num);
+			return copy_add (buf, num, strlen (num)) ? NULL : "out of memory";
+		}
+		case LUA_TSTRING:
+			break;
+		default:
+			return "invalid value in row";
+	}
+	s = lua_tolstring (L, i, &len);
+	for (start = j = 0; j < len; j++) {
+		const char *esc;
+		switch (s[j]) {
+			case '\\': esc = "\\\\"; break;
+			case '\n': esc = "\\n"; break;
+			case '\r': esc = "\\r"; break;
+			case '\t': esc = "\\t"; break;
+			default: continue;
+		}
+		if (!copy_add (buf, s + start, j - start) || !copy_add (buf, esc, 2))
+			return "out of memory";
+		start = j + 1;
+	}
+	return copy_add (buf, s + start, len - start) ? NULL : "out of memory";
+}
+
+
+/*
+** Check that the table at index row has no value after the first
+** nfields, the columns of the COPY.
+*/
+static int copy_fits (lua_State *L, int row, int nfields) {
+	lua_pushnil (L);
+	while (lua_next (L, row) != 0) {
+		lua_pop (L, 1);
+		if (lua_type (L, -1) == LUA_TNUMBER && lua_tonumber (L, -1) > nfields) {
+			lua_pop (L, 1);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+/*
+** Append the row at the top of the stack: a string, sent as is, or a
+** table with the values of the nfields columns of the COPY, where a
+** missing value is NULL.
+** Return NULL or an error message.
+*/
+static const char *copy_row (lua_State *L, copy_buffer *buf, int nfields) {
+	const char *msg = NULL;
+	int row = lua_gettop (L);
+	int i;
+	if (lua_type (L, row) == LUA_TSTRING) {
+		size_t len;
+		const char *s = lua_tolstring (L, row, &len);
+		return copy_add (buf, s, len) ? NULL : "out of memory";
+	}
+	if (!lua_istable (L, row))
+		return "invalid row";
+	if (!copy_fits (L, row, nfields))
+		return "too many values in row";
+	for (i = 1; i <= nfields && msg == NULL; i++) {
+		if (i > 1 && !copy_add (buf, "\t", 1))
+			return "out of memory";
+		lua_rawgeti (L, row, i);
+		msg = copy_value (L, buf, lua_gettop (L));
+		lua_pop (L, 1);
+	}
+	if (msg == NULL && !copy_add (buf, "\n", 1))
+		msg = "out of memory";
+	return msg;
+}
+
+
+/*
+** Wait for the result of a finished COPY and push it: the number of
+** rows copied or nil and an error message.
+*/
+static int copy_result (lua_State *L, conn_data *conn) {
+	PGresult *res, *next;
+	int ret;
+	res = PQgetResult (conn->pg_conn);
+	while ((next = PQgetResult (conn->pg_conn)) != NULL)
+		PQclear (next);
+	if (PQresultStatus (res) == PGRES_COMMAND_OK) {
+		lua_pushnumber (L, atof (PQcmdTuples (res)));
+		ret = 1;
 	}
+	else
+		ret = luasql_failmsg (L, "error copying data. PostgreSQL: ", PQerrorMessage (conn->pg_conn));
+	PQclear (res);
+	return ret;
+}
+
+
+/*
+** Execute a COPY statement, checking that it transfers data in the
+** given direction, and store its number of columns in nfields.
+** Return 0 in case of success, otherwise the number of values pushed.
+*/
+static int copy_start (lua_State *L, conn_data *conn, const char *statement, ExecStatusType status, int *nfields) {
+	PGresult *res = PQexec (conn->pg_conn, statement);
+	ExecStatusType res_status = PQresultStatus (res);
+	*nfields = PQnfields (res);
+	PQclear (res);
+	if (res_status == status)
+		return 0;
+	if (res_status == PGRES_COPY_IN || res_status == PGRES_COPY_OUT) {
+		/* wrong direction: abort it */
+		if (res_status == PGRES_COPY_IN)
+			PQputCopyEnd (conn->pg_conn, "wrong COPY direction");
+		else {
+			char *data;
+			while (PQgetCopyData (conn->pg_conn, &data, 0) > 0)
+				PQfreemem (data);
+		}
+		while ((res = PQgetResult (conn->pg_conn)) != NULL)
+			PQclear (res);
+	}
+	if (res_status == PGRES_FATAL_ERROR || res_status == PGRES_BAD_RESPONSE)
+		return luasql_failmsg (L, "error executing statement. PostgreSQL: ", PQerrorMessage (conn->pg_conn));
+	return luasql_faildirect (L, status == PGRES_COPY_IN ?
+		"statement is not a COPY FROM STDIN" : "statement is not a COPY TO STDOUT");
+}
+
+
+/*
+** Load data with a COPY ... FROM STDIN statement. The source is an
+** array of rows or an iterator which returns one at a time; a row is
+** either a table with the values of the columns, encoded in text
+** format, or a string sent as is (a chunk of text or CSV data).
+** Return the number of rows copied; an error raised by the iterator
+** aborts the COPY and is raised again.
+*/
+static int conn_copy_in (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	const char *statement = luaL_checkstring (L, 2);
+	copy_buffer buf = {NULL, 0, 0};
+	const char *msg = NULL;
+	int ret, i, iterator, nfields;
+	int err = 0;  /* index of the error raised by the iterator */
+	luaL_argcheck (L, lua_istable (L, 3) || lua_isfunction (L, 3), 3,
+		LUASQL_PREFIX"table or function expected");
+	iterator = lua_isfunction (L, 3);
+	check_stream (L, conn);
+	lua_settop (L, 3);
+	if ((ret = copy_start (L, conn, statement, PGRES_COPY_IN, &nfields)) != 0)
+		return ret;
+	conn->copying = 1;  /* the iterator can not use the connection */
+
+	for (i = 1; msg == NULL; i++) {
+		if (iterator) {
+			lua_pushvalue (L, 3);
+			if (lua_pcall (L, 0, 1, 0) != 0) {
+				err = lua_gettop (L);
+				msg = copy_error (L, "error in iterator");
+				break;
+			}
+		}
+		else
+			lua_rawgeti (L, 3, i);
+		if (lua_isnil (L, -1))
+			break;
+		msg = copy_row (L, &buf, nfields);
+		lua_pop (L, 1);
+		if (msg == NULL && buf.len >= LUASQL_PG_COPY_BUFFER) {
+			if (PQputCopyData (conn->pg_conn, buf.data, (int)buf.len) != 1)
+				msg = PQerrorMessage (conn->pg_conn);
+			buf.len = 0;
+		}
+	}
+	if (msg == NULL && buf.len > 0 &&
+			PQputCopyData (conn->pg_conn, buf.data, (int)buf.len) != 1)
+		msg = PQerrorMessage (conn->pg_conn);
+	free (buf.data);
+	if (msg != NULL) {
+		lua_pushstring (L, msg);  /* libpq may reuse its buffer */
+		msg = lua_tostring (L, -1);
+	}
+
+	/* an error message makes the server abort the COPY */
+	PQputCopyEnd (conn->pg_conn, msg);
+	conn->copying = 0;
+	ret = copy_result (L, conn);
+	if (err != 0) {
+		lua_pushvalue (L, err);
+		return lua_error (L);
+	}
+	if (msg != NULL)
+		return luasql_faildirect (L, msg);
+	return ret;
+}
+
+
+/*
+** Hand the data in the buffer to the sink: a function, called with it,
+** or an object with a write method, such as a file.
+** Return NULL or an error message, kept on the stack.
+*/
+static const char *copy_flush (lua_State *L, copy_buffer *buf, int sink) {
+	int nargs = 1;
+	if (buf->len == 0)
+		return NULL;
+	if (lua_isfunction (L, sink))
+		lua_pushvalue (L, sink);
+	else {
+		lua_getfield (L, sink, "write");
+		lua_pushvalue (L, sink);
+		nargs = 2;
+	}
+	lua_pushlstring (L, buf->data, buf->len);
+	buf->len = 0;
+	if (lua_pcall (L, nargs, 0, 0) != 0)
+		return copy_error (L, "error in sink");
+	return NULL;
+}
+
+
+/*
+** Export data with a COPY ... TO STDOUT statement, handing it to the
+** sink (a function or a file) in chunks of whole rows.
+** Return the number of rows copied; an error raised by the sink
+** discards the rest of the data and is raised again.
+*/
+static int conn_copy_out (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	const char *statement = luaL_checkstring (L, 2);
+	copy_buffer buf = {NULL, 0, 0};
+	const char *msg = NULL;
+	char *data;
+	int len, ret, nfields;
+	int err = 0;  /* index of the error raised by the sink */
+	luaL_argcheck (L, !lua_isnoneornil (L, 3), 3, LUASQL_PREFIX"function or file expected");
+	check_stream (L, conn);
+	lua_settop (L, 3);
+	if ((ret = copy_start (L, conn, statement, PGRES_COPY_OUT, &nfields)) != 0)
+		return ret;
+	conn->copying = 1;  /* the sink can not use the connection */
+
+	while ((len = PQgetCopyData (conn->pg_conn, &data, 0)) > 0) {
+		/* after an error, the rest of the data is discarded */
+		if (msg == NULL && !copy_add (&buf, data, (size_t)len))
+			msg = "out of memory";
+		PQfreemem (data);
+		if (msg == NULL && buf.len >= LUASQL_PG_COPY_BUFFER &&
+				(msg = copy_flush (L, &buf, 3)) != NULL)
+			err = lua_gettop (L);
+	}
+	if (msg == NULL && (msg = copy_flush (L, &buf, 3)) != NULL)
+		err = lua_gettop (L);
+	free (buf.data);
+	conn->copying = 0;
+	ret = copy_result (L, conn);
+	if (err != 0) {
+		lua_pushvalue (L, err);
+		return lua_error (L);
+	}
+	if (msg != NULL)
+		return luasql_faildirect (L, msg);
+	return ret;
 }
 
 
@@ -433,6 +1368,7 @@ static int conn_execute (lua_State *L) {
 */
 static int conn_commit (lua_State *L) {
 	conn_data *conn = getconnection (L);
+	check_stream (L, conn);
 	sql_commit(conn);
 	if (conn->auto_commit == 0) {
 		sql_begin(conn);
@@ -448,6 +1384,7 @@ static int conn_commit (lua_State *L) {
 */
 static int conn_rollback (lua_State *L) {
 	conn_data *conn = getconnection (L);
+	check_stream (L, conn);
 	sql_rollback(conn);
 	if (conn->auto_commit == 0) {
 		sql_begin(conn);
@@ -465,6 +1402,7 @@ static int conn_rollback (lua_State *L) {
 */
 static int conn_setautocommit (lua_State *L) {
 	conn_data *conn = getconnection (L);
+	check_stream (L, conn);
 	if (lua_toboolean (L, 2)) {
 		conn->auto_commit = 1;
 		sql_rollback(conn); /* Undo active transaction. */
@@ -489,6 +1427,12 @@ static int create_connection (lua_State *L, int env, PGconn *const pg_conn) {
 	conn->closed = 0;
 	conn->env = LUA_NOREF;
 	conn->auto_commit = 1;
+	conn->streaming = 0;
+	conn->copying = 0;
+	conn->binary = 0;
+	conn->types = LUA_NOREF;
+	conn->stmt_counter = 0;
+	conn->deferred = NULL;
 	conn->pg_conn = pg_conn;
 	lua_pushvalue (L, env);
 	conn->env = luaL_ref (L, LUA_REGISTRYINDEX);
@@ -496,6 +1440,107 @@ static int create_connection (lua_State *L, int env, PGconn *const pg_conn) {
 }
 
 
+/*
+** Release the statement. Its name is left to the connection, which
+** deallocates it on the server the next time it is used, since this
+** may run from the collector, in the middle of another operation.
+*/
+static void stmt_nullify (lua_State *L, stmt_data *stmt) {
+	conn_data *conn = stmt->conn_data;
+	stmt->closed = 1;
+	if (!conn->closed) {
+		stmt_name *s = (stmt_name *)malloc (sizeof (stmt_name) + strlen (stmt->name));
+		if (s != NULL) {
+			strcpy (s->name, stmt->name);
+			s->next = conn->deferred;
+			conn->deferred = s;
+		}
+	}
+	free (stmt->name);
+	stmt->name = NULL;
+	luaL_unref (L, LUA_REGISTRYINDEX, stmt->params);
+	luaL_unref (L, LUA_REGISTRYINDEX, stmt->conn);
+}
+
+
+/*
+** Statement object collector function
+*/
+static int stmt_gc (lua_State *L) {
+	stmt_data *stmt = (stmt_data *)luaL_checkudata (L, 1, LUASQL_STATEMENT_PG);
+	if (stmt != NULL && !(stmt->closed))
+		stmt_nullify (L, stmt);
+	return 0;
+}
+
+
+/*
+** Closes the statement on top of the stack.
+** Returns true in case of success, or false in case the statement was
+** already closed.
+*/
+static int stmt_close (lua_State *L) {
+	stmt_data *stmt = (stmt_data *)luaL_checkudata (L, 1, LUASQL_STATEMENT_PG);
+	luaL_argcheck (L, stmt != NULL, 1, LUASQL_PREFIX"statement expected");
+	if (stmt->closed) {
+		lua_pushboolean (L, 0);
+		return 1;
+	}
+	check_stream (L, stmt->conn_data);
+	stmt_nullify (L, stmt);
+	if (!stmt->conn_data->closed)
+		flush_deferred (stmt->conn_data);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Bind the given values to the parameters of the statement, in order,
+** for the next executions without values.
+*/
+static int stmt_bind (lua_State *L) {
+	stmt_data *stmt = getstatement (L);
+	params_table (L, stmt, 2);
+	luaL_unref (L, LUA_REGISTRYINDEX, stmt->params);
+	stmt->params = luaL_ref (L, LUA_REGISTRYINDEX);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Execute the prepared statement with the given parameter values, or
+** with the bound ones if no value is given.
+** Return a Cursor object if the statement is a query, otherwise
+** return the number of tuples affected by the statement.
+*/
+static int stmt_execute (lua_State *L) {
+	stmt_data *stmt = getstatement (L);
+	conn_data *conn = stmt->conn_data;
+	const char **values;
+	int params, i;
+	check_stream (L, conn);
+
+	if (lua_gettop (L) > 1)
+		params_table (L, stmt, 2);
+	else if (stmt->params != LUA_NOREF)
+		lua_rawgeti (L, LUA_REGISTRYINDEX, stmt->params);
+	else
+		lua_newtable (L);
+	params = lua_gettop (L);
+	values = (const char **)lua_newuserdata (L, (stmt->nparams + 1) * sizeof (char *));
+	for (i = 0; i < stmt->nparams; i++) {
+		lua_rawgeti (L, params, i + 1);
+		values[i] = lua_tostring (L, -1);  /* kept alive by the table */
+		lua_pop (L, 1);
+	}
+	lua_rawgeti (L, LUA_REGISTRYINDEX, stmt->conn);
+	return push_result (L, lua_gettop (L), PQexecPrepared (conn->pg_conn,
+		stmt->name, stmt->nparams, values, NULL, NULL, conn->binary));
+}
+
+
 static void notice_processor (void *arg, const char *message) {
 	(void)arg; (void)message;
 	/* arg == NULL */
@@ -571,9 +1616,15 @@ static void create_metatables (lua_State *L) {
 		{"close",         conn_close},
 		{"escape",        conn_escape},
 		{"execute",       conn_execute},
+		{"prepare",       conn_prepare},
+		{"stream",        conn_stream},
 		{"commit",        conn_commit},
 		{"rollback",      conn_rollback},
 		{"setautocommit", conn_setautocommit},
+		{"setbinary",     conn_setbinary},
+		{"loadtypes",     conn_loadtypes},
+		{"copy_in",       conn_copy_in},
+		{"copy_out",      conn_copy_out},
 		{NULL, NULL},
 	};
 	struct luaL_Reg cursor_methods[] = {
@@ -585,10 +1636,18 @@ static void create_metatables (lua_State *L) {
 		{"numrows",     cur_numrows},
 		{NULL, NULL},
 	};
+	struct luaL_Reg statement_methods[] = {
+		{"__gc",    stmt_gc},
+		{"close",   stmt_close},
+		{"bind",    stmt_bind},
+		{"execute", stmt_execute},
+		{NULL, NULL},
+	};
 	luasql_createmeta (L, LUASQL_ENVIRONMENT_PG, environment_methods);
 	luasql_createmeta (L, LUASQL_CONNECTION_PG, connection_methods);
 	luasql_createmeta (L, LUASQL_CURSOR_PG, cursor_methods);
-	lua_pop (L, 3);
+	luasql_createmeta (L, LUASQL_STATEMENT_PG, statement_methods);
+	lua_pop (L, 4);
 }
 
 /*
@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 
 #include "sqlite3.h"
 
@@ -21,6 +22,33 @@
 #define LUASQL_ENVIRONMENT_SQLITE "SQLite3 environment"
 #define LUASQL_CONNECTION_SQLITE "SQLite3 connection"
 #define LUASQL_CURSOR_SQLITE "SQLite3 cursor"
+#define LUASQL_STATEMENT_SQLITE "SQLite3 statement"
+#define LUASQL_BLOB_SQLITE "SQLite3 blob"
+#define LUASQL_POOL_SQLITE "SQLite3 pool"
+
+/* default number of idle statements kept by each connection */
+#define LUASQL_SQLITE_CACHE_SIZE 64
+
+/* SQL texts whose destination a pool remembers before forgetting all */
+#define LUASQL_SQLITE_POOL_KINDS 1024
+
+/* milliseconds to wait before retrying a locked backup step */
+#define LUASQL_SQLITE_BACKUP_SLEEP 10
+
+/* default milliseconds a backup waits for locked databases */
+#define LUASQL_SQLITE_BACKUP_TIMEOUT 5000
+
+/* virtual machine instructions between checks of the query deadline */
+#define LUASQL_SQLITE_PROGRESS_OPS 1000
+
+/* transaction control statements compiled once by each connection */
+#define TX_BEGIN      0
+#define TX_COMMIT     1
+#define TX_ROLLBACK   2
+#define TX_STATEMENTS 3
+
+/* maximum number of sqlite3_stmt_status counters kept by a cursor */
+#define LUASQL_SQLITE_COUNTERS 8
 
 typedef struct
 {
@@ -28,27 +56,269 @@ typedef struct
 } env_data;
 
 
+/*
+** Column information tables of a compiled statement, built on demand
+** and shared by the cursors which read from it.
+*/
+typedef struct
+{
+  int          names, types;       /* references to tables or LUA_NOREF */
+  int          version;            /* reprepare count of the vm they describe */
+} col_info;
+
+
+/*
+** Idle compiled statement of conn:execute, keyed by its SQL text.
+*/
+typedef struct cache_entry
+{
+  struct cache_entry *prev, *next;  /* LRU list, most recently used first */
+  struct cache_entry *hnext;        /* hash chain */
+  unsigned int       hash;
+  size_t             len;
+  sqlite3_stmt       *sql_vm;
+  col_info           info;
+  char               sql[1];
+} cache_entry;
+
+
+/*
+** Statement run recorded by the profile ring buffer.
+*/
+typedef struct
+{
+  char          *sql;
+  sqlite3_int64 ns;
+} profile_entry;
+
+
+/*
+** Row change collected by a buffered update hook.
+*/
+typedef struct
+{
+  sqlite3_int64 rowid;
+  int           op;                /* SQLITE_INSERT, SQLITE_UPDATE or SQLITE_DELETE */
+  int           table;             /* index in changes_tables */
+} change_entry;
+
+
 typedef struct
 {
   short        closed;
   int          env;                /* reference to environment */
   short        auto_commit;        /* 0 for manual commit */
+  short        tx_mode;            /* index in tx_modes of BEGIN mode */
+  sqlite3_stmt *tx_vm[TX_STATEMENTS];
   unsigned int cur_counter;
+  unsigned int stmt_counter;
+  unsigned int blob_counter;
   sqlite3      *sql_conn;
+  /* statement cache */
+  cache_entry  **cache_buckets;
+  cache_entry  *cache_head, *cache_tail;
+  unsigned int cache_nbuckets;     /* power of 2 */
+  int          cache_size, cache_capacity;
+  lua_Number   cache_hits, cache_misses, cache_evictions;
+  /* group commit */
+  int          group_limit;        /* writes per batch, 0 if disabled */
+  int          group_interval;     /* milliseconds per batch */
+  short        group_flushread;    /* commit the batch before queries */
+  short        group_open;         /* 1 while a batch is open */
+  int          group_count;        /* writes in the open batch */
+  sqlite3_int64 group_start;       /* time the open batch began */
+  int          group_largest;
+  lua_Number   group_flushes, group_writes;
+  /* busy handler */
+  int          busy_timeout;       /* milliseconds to wait for a lock */
+  int          busy_min, busy_max; /* bounds of the backoff delay */
+  sqlite3_int64 busy_start;        /* time the current wait began */
+  lua_Number   busy_events, busy_retries, busy_failures, busy_waited;
+  /* query timeout */
+  int          query_timeout;      /* milliseconds per query, 0 if none */
+  sqlite3_int64 query_deadline;    /* deadline of the running step or 0 */
+  short        timed_out;          /* 1 if the last step hit the deadline */
+  /* profiling */
+  int          profile_func;       /* reference to profile function */
+  profile_entry *profile_ring;
+  int          profile_size, profile_next, profile_count;
+  /* data change hooks */
+  int          update_func, commit_func, rollback_func; /* references */
+  short        changes_buffered;   /* collect changes for update_func */
+  short        changes_ready;      /* 1 if the collected changes committed */
+  short        changes_overflow;   /* 1 if changes were dropped */
+  int          changes_limit;      /* changes per transaction, 0 if none */
+  change_entry *changes;
+  int          changes_size, changes_count;
+  char         **changes_tables;   /* names of the changed tables */
+  int          changes_ntables;
+  /* callbacks */
+  lua_State    *L;                 /* thread calling Lua from callbacks */
+  int          thread;             /* reference to that thread */
 } conn_data;
 
 
+/*
+** Lua function called by SQL functions of a connection.
+*/
+typedef struct
+{
+  conn_data    *conn;
+  int          func;               /* reference to function or step function */
+  int          final;              /* reference to final function or LUA_NOREF */
+} func_data;
+
+
+/*
+** State of conn:executemany, shared with its protected loop.
+*/
+typedef struct
+{
+  conn_data     *conn;
+  sqlite3_stmt  *vm;
+  sqlite3_int64 deadline;
+  int           n;                 /* number of rows executed */
+  int           res;
+  lua_Number    changes;
+} bulk_data;
+
+
+typedef struct
+{
+  short        closed;
+  short        busy;               /* 1 while a cursor is reading from it */
+  int          conn;               /* reference to connection */
+  conn_data    *conn_data;         /* reference to connection for statement */
+  sqlite3_stmt *sql_vm;
+  col_info     info;
+} stmt_data;
+
+
+typedef struct
+{
+  short        closed;
+  int          next;               /* next reader to be used */
+  int          nreaders;
+  lua_Number   reads, writes;      /* statements executed by each side */
+  int          kinds;              /* reference to table: SQL -> is query */
+  int          nkinds;             /* number of SQL texts in kinds */
+  int          writer;             /* reference to writer connection */
+  int          readers[1];         /* references to reader connections */
+} pool_data;
+
+
+typedef struct
+{
+  short        closed;
+  int          conn;               /* reference to connection */
+  int          pos;                /* offset of the next read or write */
+  conn_data    *conn_data;         /* reference to connection for blob */
+  sqlite3_blob *blob;
+} blob_data;
+
+
 typedef struct
 {
   short       closed;
   int         conn;               /* reference to connection */
+  int         stmt;               /* reference to statement owning sql_vm */
   int         numcols;            /* number of columns */
-  int         colnames, coltypes; /* reference to column information tables */
+  int         pending;            /* result of a step not yet fetched or 0 */
+  sqlite3_int64 deadline;         /* deadline of the query or 0 */
+  col_info    *info;              /* column information of sql_vm */
+  col_info    own_info;           /* used if sql_vm is not shared */
   conn_data   *conn_data;         /* reference to connection for cursor */
+  stmt_data   *stmt_data;         /* statement owning sql_vm or NULL */
+  cache_entry *cache_entry;       /* cache entry owning sql_vm or NULL */
   sqlite3_stmt  *sql_vm;
+  int         stats[LUASQL_SQLITE_COUNTERS]; /* counters of sql_vm at close */
 } cur_data;
 
 
+/*
+** Transaction modes and the statements which begin them.
+*/
+static const char *const tx_modes[] = {
+  "deferred", "immediate", "exclusive", NULL
+};
+static const char *const tx_begin[] = {
+  "BEGIN DEFERRED", "BEGIN IMMEDIATE", "BEGIN EXCLUSIVE"
+};
+
+
+/*
+** Status counter of SQLite and the name it is reported with.
+*/
+typedef struct
+{
+  const char *name;
+  int        op;
+} status_counter;
+
+
+/*
+** Counters of sqlite3_stmt_status reported by cur:stats.
+*/
+static const status_counter stmt_counters[] = {
+  {"fullscan", SQLITE_STMTSTATUS_FULLSCAN_STEP},
+  {"sort", SQLITE_STMTSTATUS_SORT},
+#ifdef SQLITE_STMTSTATUS_AUTOINDEX
+  {"autoindex", SQLITE_STMTSTATUS_AUTOINDEX},
+#endif
+#ifdef SQLITE_STMTSTATUS_VM_STEP
+  {"vmstep", SQLITE_STMTSTATUS_VM_STEP},
+#endif
+#ifdef SQLITE_STMTSTATUS_REPREPARE
+  {"reprepare", SQLITE_STMTSTATUS_REPREPARE},
+#endif
+#ifdef SQLITE_STMTSTATUS_RUN
+  {"run", SQLITE_STMTSTATUS_RUN},
+#endif
+#ifdef SQLITE_STMTSTATUS_MEMUSED
+  {"memused", SQLITE_STMTSTATUS_MEMUSED},
+#endif
+  {NULL, 0}
+};
+
+
+/*
+** Counters of sqlite3_status reported by env:memstats.
+*/
+static const status_counter mem_counters[] = {
+  {"memory_used", SQLITE_STATUS_MEMORY_USED},
+  {"malloc_size", SQLITE_STATUS_MALLOC_SIZE},
+#ifdef SQLITE_STATUS_MALLOC_COUNT
+  {"malloc_count", SQLITE_STATUS_MALLOC_COUNT},
+#endif
+  {"pagecache_used", SQLITE_STATUS_PAGECACHE_USED},
+  {"pagecache_overflow", SQLITE_STATUS_PAGECACHE_OVERFLOW},
+  {"pagecache_size", SQLITE_STATUS_PAGECACHE_SIZE},
+  {NULL, 0}
+};
+
+
+/*
+** Counters of sqlite3_db_status reported by conn:dbstatus.
+*/
+static const status_counter db_counters[] = {
+  {"lookaside_used", SQLITE_DBSTATUS_LOOKASIDE_USED},
+  {"cache_used", SQLITE_DBSTATUS_CACHE_USED},
+  {"schema_used", SQLITE_DBSTATUS_SCHEMA_USED},
+  {"stmt_used", SQLITE_DBSTATUS_STMT_USED},
+#ifdef SQLITE_DBSTATUS_CACHE_HIT
+  {"cache_hit", SQLITE_DBSTATUS_CACHE_HIT},
+  {"cache_miss", SQLITE_DBSTATUS_CACHE_MISS},
+#endif
+#ifdef SQLITE_DBSTATUS_CACHE_WRITE
+  {"cache_write", SQLITE_DBSTATUS_CACHE_WRITE},
+#endif
+#ifdef SQLITE_DBSTATUS_CACHE_SPILL
+  {"cache_spill", SQLITE_DBSTATUS_CACHE_SPILL},
+#endif
+  {NULL, 0}
+};
+
+
 /*
 ** Check for valid environment.
 */
@@ -81,407 +351,2984 @@ static cur_data *getcursor(lua_State *L) {
   return cur;
 }
 
+
 /*
-** Closes the cursor and nullify all structure fields.
+** Check for valid statement.
 */
-static void cur_nullify(lua_State *L, cur_data *cur)
+static stmt_data *getstatement(lua_State *L) {
+  stmt_data *stmt = (stmt_data *)luaL_checkudata (L, 1, LUASQL_STATEMENT_SQLITE);
+  luaL_argcheck(L, stmt != NULL, 1, LUASQL_PREFIX"statement expected");
+  luaL_argcheck(L, !stmt->closed, 1, LUASQL_PREFIX"statement is closed");
+  return stmt;
+}
+
+/*
+** Hash of an SQL text (FNV-1a).
+*/
+static unsigned int cache_hash(const char *sql, size_t len)
 {
-  conn_data *conn;
+  unsigned int h = 2166136261u;
+  size_t i;
+  for (i = 0; i < len; i++)
+    h = (h ^ (unsigned char)sql[i]) * 16777619u;
+  return h;
+}
 
-  /* Nullify structure fields. */
-  cur->closed = 1;
-  cur->sql_vm = NULL;
-  /* Decrement cursor counter on connection object */
-  lua_rawgeti (L, LUA_REGISTRYINDEX, cur->conn);
-  conn = lua_touserdata (L, -1);
-  conn->cur_counter--;
 
-  luaL_unref(L, LUA_REGISTRYINDEX, cur->conn);
-  luaL_unref(L, LUA_REGISTRYINDEX, cur->colnames);
-  luaL_unref(L, LUA_REGISTRYINDEX, cur->coltypes);
+/*
+** Release the column information tables.
+*/
+static void colinfo_clear(lua_State *L, col_info *info)
+{
+  luaL_unref(L, LUA_REGISTRYINDEX, info->names);
+  luaL_unref(L, LUA_REGISTRYINDEX, info->types);
+  info->names = info->types = LUA_NOREF;
 }
 
 
 /*
-** Finalizes the vm
-** Return nil + errmsg or nil in case of sucess
+** Push the table of column names (or types, if types is true) of vm,
+** creating it the first time it is needed or after vm was compiled
+** again (which may change its columns).
 */
-static int finalize(lua_State *L, cur_data *cur) {
-  const char *errmsg;
-  if (sqlite3_finalize(cur->sql_vm) != SQLITE_OK)
+static void colinfo_push(lua_State *L, col_info *info, sqlite3_stmt *vm, int types)
+{
+  int *ref = types ? &info->types : &info->names;
+  int version = 0;
+  int i, numcols;
+
+#ifdef SQLITE_STMTSTATUS_REPREPARE
+  version = sqlite3_stmt_status(vm, SQLITE_STMTSTATUS_REPREPARE, 0);
+#endif
+  if (version != info->version)
     {
-      errmsg = sqlite3_errmsg(cur->conn_data->sql_conn);
-      cur_nullify(L, cur);
-      return luasql_faildirect(L, errmsg);
+      colinfo_clear(L, info);
+      info->version = version;
     }
-  cur_nullify(L, cur);
-  lua_pushnil(L);
-  return 1;
+  if (*ref != LUA_NOREF)
+    {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, *ref);
+      return;
+    }
+
+  numcols = sqlite3_column_count(vm);
+  lua_createtable(L, numcols, 0);
+  for (i = 0; i < numcols;)
+    {
+      lua_pushstring(L, types ? sqlite3_column_decltype(vm, i) : sqlite3_column_name(vm, i));
+      lua_rawseti(L, -2, ++i);
+    }
+  lua_pushvalue(L, -1);
+  *ref = luaL_ref(L, LUA_REGISTRYINDEX);
 }
 
 
-static void push_column(lua_State *L, sqlite3_stmt *vm, int column) {
-  switch (sqlite3_column_type(vm, column)) {
-  case SQLITE_INTEGER:
-#if LUA_VERSION_NUM >= 503
-    lua_pushinteger(L, sqlite3_column_int64(vm, column));
-#else
-    // Preserves precision of integers up to 2^53.
-    lua_pushnumber(L, sqlite3_column_int64(vm, column));
-#endif
-    break;
-  case SQLITE_FLOAT:
-    lua_pushnumber(L, sqlite3_column_double(vm, column));
-    break;
-  case SQLITE_TEXT:
-    lua_pushlstring(L, (const char *)sqlite3_column_text(vm, column),
-		    (size_t)sqlite3_column_bytes(vm, column));
-    break;
-  case SQLITE_BLOB:
-    lua_pushlstring(L, sqlite3_column_blob(vm, column),
-		    (size_t)sqlite3_column_bytes(vm, column));
-    break;
-  case SQLITE_NULL:
-    lua_pushnil(L);
-    break;
-  default:
-    luaL_error(L, LUASQL_PREFIX"Unrecognized column type");
-    break;
-  }
+/*
+** Push a new copy of the table of column names (or types) of vm,
+** so the caller may modify it without changing the cached one.
+*/
+static void colinfo_pushcopy(lua_State *L, col_info *info, sqlite3_stmt *vm, int types)
+{
+  int i, numcols;
+  colinfo_push(L, info, vm, types);
+  numcols = sqlite3_column_count(vm);
+  lua_createtable(L, numcols, 0);
+  for (i = 1; i <= numcols; i++)
+    {
+      lua_rawgeti(L, -2, i);
+      lua_rawseti(L, -2, i);
+    }
+  lua_remove(L, -2);
 }
 
 
 /*
-** Get another row of the given cursor.
+** Removes an entry from the cache structures.
 */
-static int cur_fetch (lua_State *L) {
-  cur_data *cur = getcursor(L);
-  sqlite3_stmt *vm = cur->sql_vm;
-  int res;
-
-  if (vm == NULL)
-    return 0;
+static void cache_unlink(conn_data *conn, cache_entry *e)
+{
+  cache_entry **p = &conn->cache_buckets[e->hash & (conn->cache_nbuckets-1)];
+  while (*p != e)
+    p = &(*p)->hnext;
+  *p = e->hnext;
+  if (e->prev) e->prev->next = e->next; else conn->cache_head = e->next;
+  if (e->next) e->next->prev = e->prev; else conn->cache_tail = e->prev;
+  conn->cache_size--;
+}
 
-  res = sqlite3_step(vm);
 
-  /* no more results? */
-  if (res == SQLITE_DONE)
-    return finalize(L, cur);
+/*
+** Finalizes the statement of an entry and frees it.
+*/
+static void cache_evict(lua_State *L, conn_data *conn, cache_entry *e)
+{
+  cache_unlink(conn, e);
+  colinfo_clear(L, &e->info);
+  sqlite3_finalize(e->sql_vm);
+  free(e);
+  conn->cache_evictions++;
+}
 
-  if (res != SQLITE_ROW)
-    return finalize(L, cur);
 
-  if (lua_istable (L, 2))
-    {
-      int i;
-      const char *opts = luaL_optstring(L, 3, "n");
+/*
+** Evicts least recently used entries until the cache fits its capacity.
+*/
+static void cache_trim(lua_State *L, conn_data *conn)
+{
+  while (conn->cache_size > conn->cache_capacity)
+    cache_evict(L, conn, conn->cache_tail);
+}
 
-      if (strchr(opts, 'n') != NULL)
-        {
-        /* Copy values to numerical indices */
-          for (i = 0; i < cur->numcols;)
-            {
-              push_column(L, vm, i);
-              lua_rawseti(L, 2, ++i);
-            }
-        }
-      if (strchr(opts, 'a') != NULL)
-        {
-          /* Copy values to alphanumerical indices */
-          lua_rawgeti(L, LUA_REGISTRYINDEX, cur->colnames);
 
-          for (i = 0; i < cur->numcols; i++)
-            {
-              lua_rawgeti(L, -1, i+1);
-              push_column(L, vm, i);
-              lua_rawset (L, 2);
-            }
-        }
-      lua_pushvalue(L, 2);
-      return 1; /* return table */
+/*
+** Takes the statement compiled for the given SQL text out of the cache.
+** Return NULL if there is none.
+*/
+static cache_entry *cache_get(conn_data *conn, const char *sql, size_t len)
+{
+  cache_entry *e = NULL;
+  if (conn->cache_capacity > 0)
+    {
+      unsigned int h = cache_hash(sql, len);
+      for (e = conn->cache_buckets[h & (conn->cache_nbuckets-1)]; e; e = e->hnext)
+        if (e->hash == h && e->len == len && memcmp(e->sql, sql, len) == 0)
+          break;
+    }
+  if (e != NULL)
+    {
+      cache_unlink(conn, e);
+      conn->cache_hits++;
     }
   else
+    conn->cache_misses++;
+  return e;
+}
+
+
+/*
+** Creates an entry for a statement not yet in the cache.
+** Return NULL if the statement should not be cached.
+*/
+static cache_entry *cache_newentry(conn_data *conn, const char *sql, size_t len,
+				   sqlite3_stmt *vm)
+{
+  cache_entry *e;
+  if (conn->cache_capacity <= 0 || vm == NULL)
+    return NULL;
+  e = (cache_entry *)malloc(sizeof(cache_entry) + len);
+  if (e != NULL)
     {
-      int i;
-      luaL_checkstack (L, cur->numcols, LUASQL_PREFIX"too many columns");
-      for (i = 0; i < cur->numcols; ++i)
-        push_column(L, vm, i);
-      return cur->numcols; /* return #numcols values */
+      e->hash = cache_hash(sql, len);
+      e->len = len;
+      e->sql_vm = vm;
+      e->info.names = e->info.types = LUA_NOREF;
+      e->info.version = 0;
+      memcpy(e->sql, sql, len);
+      e->sql[len] = '\0';
     }
+  return e;
 }
 
 
 /*
-** Cursor object collector function
+** Gives an idle entry back to the cache, as its most recently used one.
+** The entry is dropped if the cache is disabled or already has an
+** idle statement for the same SQL text.
 */
-static int cur_gc(lua_State *L)
+static void cache_put(lua_State *L, conn_data *conn, cache_entry *e)
 {
-  cur_data *cur = (cur_data *)luaL_checkudata(L, 1, LUASQL_CURSOR_SQLITE);
-  if (cur != NULL && !(cur->closed))
+  cache_entry **bucket = NULL, *old = NULL;
+  if (conn->cache_capacity > 0)
     {
-      sqlite3_finalize(cur->sql_vm);
-      cur_nullify(L, cur);
+      bucket = &conn->cache_buckets[e->hash & (conn->cache_nbuckets-1)];
+      for (old = *bucket; old; old = old->hnext)
+        if (old->hash == e->hash && old->len == e->len &&
+            memcmp(old->sql, e->sql, e->len) == 0)
+          break;
     }
-  return 0;
+  if (conn->cache_capacity <= 0 || old != NULL)
+    {
+      colinfo_clear(L, &e->info);
+      sqlite3_finalize(e->sql_vm);
+      free(e);
+      return;
+    }
+  e->hnext = *bucket;
+  *bucket = e;
+  e->prev = NULL;
+  e->next = conn->cache_head;
+  if (conn->cache_head) conn->cache_head->prev = e; else conn->cache_tail = e;
+  conn->cache_head = e;
+  conn->cache_size++;
+  cache_trim(L, conn);
 }
 
 
 /*
-** Close the cursor on top of the stack.
-** Return 1
+** Changes the capacity of the cache, evicting entries if needed.
+** Return 0 if there is no memory for the new hash table.
 */
-static int cur_close(lua_State *L)
+static int cache_resize(lua_State *L, conn_data *conn, int capacity)
 {
-  cur_data *cur = (cur_data *)luaL_checkudata(L, 1, LUASQL_CURSOR_SQLITE);
-  luaL_argcheck(L, cur != NULL, 1, LUASQL_PREFIX"cursor expected");
-  if (cur->closed) {
-    lua_pushboolean(L, 0);
-    return 1;
-  }
-  sqlite3_finalize(cur->sql_vm);
-  cur_nullify(L, cur);
-  lua_pushboolean(L, 1);
+  unsigned int nbuckets = 16;
+  cache_entry **buckets;
+  cache_entry *e;
+
+  if (capacity < 0)
+    capacity = 0;
+  while (nbuckets < (unsigned int)capacity)
+    nbuckets <<= 1;
+  conn->cache_capacity = capacity < conn->cache_capacity ? capacity : conn->cache_capacity;
+  cache_trim(L, conn);
+  if (nbuckets != conn->cache_nbuckets)
+    {
+      buckets = (cache_entry **)calloc(nbuckets, sizeof(cache_entry *));
+      if (buckets == NULL)
+        return 0;
+      for (e = conn->cache_head; e; e = e->next)
+        {
+          e->hnext = buckets[e->hash & (nbuckets-1)];
+          buckets[e->hash & (nbuckets-1)] = e;
+        }
+      free(conn->cache_buckets);
+      conn->cache_buckets = buckets;
+      conn->cache_nbuckets = nbuckets;
+    }
+  conn->cache_capacity = capacity;
   return 1;
 }
 
 
 /*
-** Return the list of field names.
+** Finalizes all statements in the cache.
 */
-static int cur_getcolnames(lua_State *L)
+static void cache_clear(lua_State *L, conn_data *conn)
 {
-  cur_data *cur = getcursor(L);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, cur->colnames);
-  return 1;
+  while (conn->cache_head)
+    cache_evict(L, conn, conn->cache_head);
+  free(conn->cache_buckets);
+  conn->cache_buckets = NULL;
+  conn->cache_nbuckets = 0;
+  conn->cache_capacity = 0;
 }
 
 
 /*
-** Return the list of field types.
+** Releases a vm compiled for conn:execute.
+** Cached statements are reset and given back to the cache; other ones
+** are finalized.
 */
-static int cur_getcoltypes(lua_State *L)
+static int release_vm(lua_State *L, conn_data *conn, cache_entry *entry,
+		      sqlite3_stmt *vm)
 {
-  cur_data *cur = getcursor(L);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, cur->coltypes);
-  return 1;
+  int res;
+  if (entry == NULL)
+    return sqlite3_finalize(vm);
+  res = sqlite3_reset(vm);
+  cache_put(L, conn, entry);
+  return res;
 }
 
 
 /*
-** Create a new Cursor object and push it on top of the stack.
+** Return the boolean value of a field of the options table.
 */
-/* static int create_cursor(lua_State *L, int conn, sqlite3_stmt *sql_vm,
-   int numcols, const char **row, const char **col_info)*/
-static int create_cursor(lua_State *L, int o, conn_data *conn,
-			 sqlite3_stmt *sql_vm, int numcols)
+static int opt_boolean(lua_State *L, int opts, const char *name, int def)
 {
-  int i;
-  cur_data *cur = (cur_data*)lua_newuserdata(L, sizeof(cur_data));
-  luasql_setmeta (L, LUASQL_CURSOR_SQLITE);
+  lua_getfield(L, opts, name);
+  if (!lua_isnil(L, -1))
+    def = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return def;
+}
 
-  /* increment cursor count for the connection creating this cursor */
-  conn->cur_counter++;
 
-  /* fill in structure */
-  cur->closed = 0;
+/*
+** Return the numeric value of a field of the options table.
+*/
+static lua_Number opt_number(lua_State *L, int opts, const char *name,
+			     lua_Number def)
+{
+  lua_getfield(L, opts, name);
+  if (!lua_isnil(L, -1))
+    {
+      if (!lua_isnumber(L, -1))
+        luaL_error(L, LUASQL_PREFIX"option '%s' must be a number", name);
+      def = lua_tonumber(L, -1);
+    }
+  lua_pop(L, 1);
+  return def;
+}
+
+
+/*
+** Current time in milliseconds, as given by the default VFS.
+*/
+static sqlite3_int64 now_ms(void)
+{
+  sqlite3_vfs *vfs = sqlite3_vfs_find(NULL);
+  sqlite3_int64 t = 0;
+  if (vfs == NULL)
+    return 0;
+  if (vfs->iVersion >= 2 && vfs->xCurrentTimeInt64 != NULL)
+    vfs->xCurrentTimeInt64(vfs, &t);
+  else
+    {
+      double d;
+      vfs->xCurrentTime(vfs, &d);
+      t = (sqlite3_int64)(d * 86400000.0);
+    }
+  return t;
+}
+
+
+/*
+** Return the deadline of a query starting now, or 0 if the connection
+** has no query timeout.
+*/
+static sqlite3_int64 query_deadline(conn_data *conn)
+{
+  return (conn->query_timeout > 0) ? now_ms() + conn->query_timeout : 0;
+}
+
+
+/*
+** Name of the operation of a data change.
+*/
+static const char *change_name(int op)
+{
+  switch (op) {
+  case SQLITE_INSERT:
+    return "insert";
+  case SQLITE_DELETE:
+    return "delete";
+  default:
+    return "update";
+  }
+}
+
+
+/*
+** Discard the changes collected by the buffered update hook.
+*/
+static void changes_reset(conn_data *conn)
+{
+  int i;
+  for (i = 0; i < conn->changes_ntables; i++)
+    free(conn->changes_tables[i]);
+  conn->changes_ntables = 0;
+  conn->changes_count = 0;
+  conn->changes_ready = conn->changes_overflow = 0;
+}
+
+
+/*
+** Collect a change of the transaction, or mark the batch as incomplete
+** if it exceeds the limit or memory runs out.
+*/
+static void changes_add(conn_data *conn, int op, const char *table,
+			sqlite3_int64 rowid)
+{
+  change_entry *entry;
+  int t;
+
+  if (conn->changes_overflow)
+    return;
+  if (conn->changes_limit > 0 && conn->changes_count >= conn->changes_limit)
+    {
+      conn->changes_overflow = 1;
+      return;
+    }
+  if (conn->changes_count == conn->changes_size)
+    {
+      int size = (conn->changes_size > 0) ? 2 * conn->changes_size : 64;
+      change_entry *changes = (change_entry *)realloc(conn->changes,
+						      size * sizeof(change_entry));
+      if (changes == NULL)
+        {
+          conn->changes_overflow = 1;
+          return;
+        }
+      conn->changes = changes;
+      conn->changes_size = size;
+    }
+  /* transactions usually change a few tables: search the latest first */
+  for (t = conn->changes_ntables - 1; t >= 0; t--)
+    if (strcmp(conn->changes_tables[t], table) == 0)
+      break;
+  if (t < 0)
+    {
+      char **tables = (char **)realloc(conn->changes_tables,
+				       (conn->changes_ntables + 1) * sizeof(char *));
+      char *name = (char *)malloc(strlen(table) + 1);
+      if (tables != NULL)
+        conn->changes_tables = tables;
+      if (tables == NULL || name == NULL)
+        {
+          free(name);
+          conn->changes_overflow = 1;
+          return;
+        }
+      strcpy(name, table);
+      t = conn->changes_ntables++;
+      conn->changes_tables[t] = name;
+    }
+  entry = &conn->changes[conn->changes_count++];
+  entry->rowid = rowid;
+  entry->op = op;
+  entry->table = t;
+}
+
+
+/*
+** Hand the changes of a committed transaction to the update function,
+** as a list of {op=, table=, rowid=} tables with the field overflow set
+** if some changes were dropped.
+** Errors of the function are ignored.
+*/
+static void changes_deliver(conn_data *conn)
+{
+  lua_State *L = conn->L;
+  int i;
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, conn->update_func);
+  lua_createtable(L, conn->changes_count, 1);
+  for (i = 0; i < conn->changes_count; i++)
+    {
+      change_entry *entry = &conn->changes[i];
+      lua_createtable(L, 0, 3);
+      lua_pushstring(L, change_name(entry->op));
+      lua_setfield(L, -2, "op");
+      lua_pushstring(L, conn->changes_tables[entry->table]);
+      lua_setfield(L, -2, "table");
+      lua_pushnumber(L, (lua_Number)entry->rowid);
+      lua_setfield(L, -2, "rowid");
+      lua_rawseti(L, -2, i + 1);
+    }
+  if (conn->changes_overflow)
+    {
+      lua_pushboolean(L, 1);
+      lua_setfield(L, -2, "overflow");
+    }
+  /* the function may change the database again */
+  changes_reset(conn);
+  if (lua_pcall(L, 1, 0, 0) != 0)
+    lua_pop(L, 1);
+}
+
+
+/*
+** Step vm, interrupting it if the deadline (if not 0) passes.
+** The changes of a transaction committed by the step are delivered
+** once it returns.
+*/
+static int query_step(conn_data *conn, sqlite3_stmt *vm, sqlite3_int64 deadline)
+{
+  int res;
+  conn->timed_out = 0;
+  conn->query_deadline = deadline;
+  res = sqlite3_step(vm);
+  conn->query_deadline = 0;
+  if (conn->changes_ready)
+    changes_deliver(conn);
+  return res;
+}
+
+
+/*
+** Progress handler: interrupt the running step after its deadline.
+*/
+static int progress_handler(void *ctx)
+{
+  conn_data *conn = (conn_data *)ctx;
+  if (conn->query_deadline != 0 && now_ms() >= conn->query_deadline)
+    {
+      conn->timed_out = 1;
+      return 1;
+    }
+  return 0;
+}
+
+
+/*
+** Return the message of the error of the last step of the connection.
+*/
+static const char *step_errmsg(conn_data *conn)
+{
+  if (conn->timed_out)
+    return "query timed out";
+  return sqlite3_errmsg(conn->sql_conn);
+}
+
+
+/*
+** Compiles the first SQL statement of the given string.
+** 'persistent' hints SQLite that the vm will be kept and reused.
+** If 'tail' is not NULL, it receives the rest of the string.
+*/
+static int sql_prepare(conn_data *conn, const char *statement, int persistent,
+		       sqlite3_stmt **vm, const char **tail)
+{
+#if SQLITE_VERSION_NUMBER >= 3020000
+  return sqlite3_prepare_v3(conn->sql_conn, statement, -1,
+			    persistent ? SQLITE_PREPARE_PERSISTENT : 0, vm, tail);
+#elif SQLITE_VERSION_NUMBER > 3006013
+  (void)persistent;
+  return sqlite3_prepare_v2(conn->sql_conn, statement, -1, vm, tail);
+#else
+  (void)persistent;
+  return sqlite3_prepare(conn->sql_conn, statement, -1, vm, tail);
+#endif
+}
+
+
+/*
+** Execute a transaction control statement (TX_BEGIN, TX_COMMIT or
+** TX_ROLLBACK), compiling it only the first time.
+** BEGIN starts a transaction of the mode of the connection.
+*/
+static int tx_exec(conn_data *conn, int which)
+{
+  sqlite3_stmt **vm = &conn->tx_vm[which];
+  int res;
+  if (*vm == NULL)
+    {
+      const char *sql = (which == TX_BEGIN) ? tx_begin[conn->tx_mode] :
+                        (which == TX_COMMIT) ? "COMMIT" : "ROLLBACK";
+      res = sql_prepare(conn, sql, 1, vm, NULL);
+      if (res != SQLITE_OK)
+        return res;
+    }
+  res = sqlite3_step(*vm);
+  sqlite3_reset(*vm);
+  if (conn->changes_ready)
+    changes_deliver(conn);
+  return (res == SQLITE_DONE) ? SQLITE_OK : res;
+}
+
+
+/*
+** Finalize the transaction control statements of the connection.
+*/
+static void tx_clear(conn_data *conn)
+{
+  int i;
+  for (i = 0; i < TX_STATEMENTS; i++)
+    {
+      sqlite3_finalize(conn->tx_vm[i]);
+      conn->tx_vm[i] = NULL;
+    }
+}
+
+
+/*
+** Begin the transaction of a batch of statements, or a savepoint if the
+** connection is in a transaction already (nested is true).
+*/
+static int batch_begin(conn_data *conn, int nested)
+{
+  if (nested)
+    return sqlite3_exec(conn->sql_conn, "SAVEPOINT luasql_batch", NULL, NULL, NULL);
+  return tx_exec(conn, TX_BEGIN);
+}
+
+
+/*
+** End the transaction or savepoint of a batch, keeping its changes if
+** commit is true or undoing them otherwise.
+*/
+static int batch_end(conn_data *conn, int nested, int commit)
+{
+  if (nested)
+    return sqlite3_exec(conn->sql_conn, commit ? "RELEASE luasql_batch" :
+			"ROLLBACK TO luasql_batch; RELEASE luasql_batch",
+			NULL, NULL, NULL);
+  return tx_exec(conn, commit ? TX_COMMIT : TX_ROLLBACK);
+}
+
+
+/*
+** Commit the open group commit batch, if any.
+*/
+static int group_flush(conn_data *conn)
+{
+  int res;
+  if (!conn->group_open)
+    return SQLITE_OK;
+  res = tx_exec(conn, TX_COMMIT);
+  if (res == SQLITE_OK)
+    {
+      conn->group_flushes++;
+      conn->group_writes += conn->group_count;
+      if (conn->group_count > conn->group_largest)
+        conn->group_largest = conn->group_count;
+    }
+  else if (!sqlite3_get_autocommit(conn->sql_conn))
+    return res;  /* still open: retried by the next flush */
+  conn->group_open = 0;
+  conn->group_count = 0;
+  return res;
+}
+
+
+/*
+** Prepare the execution of vm under group commit.
+** A write joins the open batch, starting a new one if needed.
+** Commands that are not writes (BEGIN, COMMIT, PRAGMA...) and, if so
+** configured, queries commit the batch first.
+*/
+static void group_before(conn_data *conn, sqlite3_stmt *vm)
+{
+  if (conn->group_limit <= 0 || !conn->auto_commit || vm == NULL)
+    return;
+  if (!sqlite3_stmt_readonly(vm))
+    {
+      if (!conn->group_open && sqlite3_get_autocommit(conn->sql_conn) &&
+	  tx_exec(conn, TX_BEGIN) == SQLITE_OK)
+        {
+          conn->group_open = 1;
+          conn->group_start = now_ms();
+        }
+    }
+  else if (conn->group_open &&
+	   (conn->group_flushread || sqlite3_column_count(vm) == 0))
+    group_flush(conn);
+}
+
+
+/*
+** Account a step of vm under group commit, committing the batch when
+** it is full or old enough.
+** Return 1 if an error rolled back the whole batch.
+*/
+static int group_after(conn_data *conn, sqlite3_stmt *vm, int res)
+{
+  if (!conn->group_open)
+    return 0;
+  if (sqlite3_get_autocommit(conn->sql_conn))
+    {
+      conn->group_open = 0;
+      conn->group_count = 0;
+      return 1;
+    }
+  if ((res == SQLITE_DONE || res == SQLITE_ROW) && !sqlite3_stmt_readonly(vm))
+    {
+      conn->group_count++;
+      if (conn->group_count >= conn->group_limit ||
+	  now_ms() - conn->group_start >= conn->group_interval)
+        group_flush(conn);
+    }
+  return 0;
+}
+
+
+/*
+** Push the error of a statement executed under group commit.
+*/
+static int group_fail(lua_State *L, conn_data *conn, int lost)
+{
+  if (lost)
+    return luasql_failmsg(L, step_errmsg(conn),
+			  " (the uncommitted writes of the group were rolled back)");
+  return luasql_faildirect(L, step_errmsg(conn));
+}
+
+
+/*
+** Configure group commit from the table at index idx, or disable it
+** if that value is false or nil.
+*/
+static int group_configure(lua_State *L, conn_data *conn, int idx)
+{
+  int res = group_flush(conn);
+  if (lua_istable(L, idx))
+    {
+      conn->group_limit = (int)opt_number(L, idx, "statements", 100);
+      conn->group_interval = (int)opt_number(L, idx, "interval", 1000);
+      conn->group_flushread = (short)opt_boolean(L, idx, "flushonread", 0);
+    }
+  else
+    conn->group_limit = 0;
+  return res;
+}
+
+
+/*
+** Busy handler: wait with a jittered exponential backoff until the
+** lock is released or the deadline of the connection expires.
+*/
+static int busy_handler(void *ctx, int count)
+{
+  conn_data *conn = (conn_data *)ctx;
+  sqlite3_int64 now = now_ms();
+  sqlite3_int64 left;
+  int delay;
+  unsigned int jitter;
+
+  if (count == 0)
+    {
+      conn->busy_events++;
+      conn->busy_start = now;
+    }
+  left = conn->busy_start + conn->busy_timeout - now;
+  if (left <= 0)
+    {
+      conn->busy_failures++;
+      return 0;
+    }
+
+  delay = conn->busy_min;
+  while (count-- > 0 && delay < conn->busy_max)
+    delay *= 2;
+  if (delay > conn->busy_max)
+    delay = conn->busy_max;
+  /* wait between half and all of the delay, so competing connections
+     do not retry in lockstep */
+  sqlite3_randomness(sizeof(jitter), &jitter);
+  delay = delay / 2 + (int)(jitter % (unsigned int)(delay / 2 + 1));
+  if (delay > left)
+    delay = (int)left;
+  if (delay < 1)
+    delay = 1;
+
+  sqlite3_sleep(delay);
+  conn->busy_retries++;
+  conn->busy_waited += (lua_Number)(now_ms() - now);
+  return 1;
+}
+
+
+/*
+** Configure the busy handler from the table at index idx, or remove
+** it if that value is false or nil.
+*/
+static void busy_configure(lua_State *L, conn_data *conn, int idx)
+{
+  if (lua_istable(L, idx))
+    {
+      conn->busy_timeout = (int)opt_number(L, idx, "timeout", 5000);
+      conn->busy_min = (int)opt_number(L, idx, "min", 1);
+      conn->busy_max = (int)opt_number(L, idx, "max", 100);
+      if (conn->busy_min < 1)
+        conn->busy_min = 1;
+      if (conn->busy_max < conn->busy_min)
+        conn->busy_max = conn->busy_min;
+      sqlite3_busy_handler(conn->sql_conn, busy_handler, conn);
+    }
+  else
+    sqlite3_busy_handler(conn->sql_conn, NULL, NULL);
+}
+
+
+/*
+** Check for valid pool.
+*/
+static pool_data *getpool(lua_State *L) {
+  pool_data *pool = (pool_data *)luaL_checkudata (L, 1, LUASQL_POOL_SQLITE);
+  luaL_argcheck(L, pool != NULL, 1, LUASQL_PREFIX"pool expected");
+  luaL_argcheck(L, !pool->closed, 1, LUASQL_PREFIX"pool is closed");
+  return pool;
+}
+
+
+/*
+** Check for valid blob.
+*/
+static blob_data *getblob(lua_State *L) {
+  blob_data *blob = (blob_data *)luaL_checkudata (L, 1, LUASQL_BLOB_SQLITE);
+  luaL_argcheck(L, blob != NULL, 1, LUASQL_PREFIX"blob expected");
+  luaL_argcheck(L, !blob->closed, 1, LUASQL_PREFIX"blob is closed");
+  return blob;
+}
+
+/*
+** Closes the cursor and nullify all structure fields.
+*/
+static void cur_nullify(lua_State *L, cur_data *cur)
+{
+  conn_data *conn;
+
+  /* Nullify structure fields. */
+  cur->closed = 1;
+  cur->sql_vm = NULL;
+  /* Decrement cursor counter on connection object */
+  lua_rawgeti (L, LUA_REGISTRYINDEX, cur->conn);
+  conn = lua_touserdata (L, -1);
+  conn->cur_counter--;
+
+  /* Give the vm back to its statement */
+  if (cur->stmt_data != NULL)
+    cur->stmt_data->busy = 0;
+
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->conn);
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->stmt);
+  colinfo_clear(L, &cur->own_info);
+}
+
+
+/*
+** Reset the counters of vm, so a cursor reports those of its own query
+** even when vm is reused.
+*/
+static void stmt_resetstats(sqlite3_stmt *vm)
+{
+  int i;
+  for (i = 0; stmt_counters[i].name != NULL; i++)
+    sqlite3_stmt_status(vm, stmt_counters[i].op, 1);
+}
+
+
+/*
+** Keep the counters of the vm of a cursor, so they are still available
+** after it is closed.
+*/
+static void cur_getstats(cur_data *cur)
+{
+  int i;
+  for (i = 0; stmt_counters[i].name != NULL; i++)
+    cur->stats[i] = sqlite3_stmt_status(cur->sql_vm, stmt_counters[i].op, 0);
+}
+
+
+/*
+** Releases the vm of a cursor.
+** A vm owned by a statement object is only reset so it can be executed
+** again; a cached one is given back to the cache; otherwise it is
+** finalized.
+*/
+static int cur_release_vm(lua_State *L, cur_data *cur)
+{
+  cur_getstats(cur);
+  if (cur->stmt_data != NULL)
+    return sqlite3_reset(cur->sql_vm);
+  return release_vm(L, cur->conn_data, cur->cache_entry, cur->sql_vm);
+}
+
+
+/*
+** Finalizes the vm
+** Return nil + errmsg or nil in case of sucess
+*/
+static int finalize(lua_State *L, cur_data *cur) {
+  const char *errmsg;
+  if (cur_release_vm(L, cur) != SQLITE_OK)
+    {
+      errmsg = step_errmsg(cur->conn_data);
+      cur_nullify(L, cur);
+      return luasql_faildirect(L, errmsg);
+    }
+  cur_nullify(L, cur);
+  lua_pushnil(L);
+  return 1;
+}
+
+
+static void push_value(lua_State *L, sqlite3_value *value) {
+  switch (sqlite3_value_type(value)) {
+  case SQLITE_INTEGER:
+#if LUA_VERSION_NUM >= 503
+    lua_pushinteger(L, sqlite3_value_int64(value));
+#else
+    // Preserves precision of integers up to 2^53.
+    lua_pushnumber(L, sqlite3_value_int64(value));
+#endif
+    break;
+  case SQLITE_FLOAT:
+    lua_pushnumber(L, sqlite3_value_double(value));
+    break;
+  case SQLITE_TEXT:
+    lua_pushlstring(L, (const char *)sqlite3_value_text(value),
+		    (size_t)sqlite3_value_bytes(value));
+    break;
+  case SQLITE_BLOB:
+    lua_pushlstring(L, sqlite3_value_blob(value),
+		    (size_t)sqlite3_value_bytes(value));
+    break;
+  case SQLITE_NULL:
+    lua_pushnil(L);
+    break;
+  default:
+    luaL_error(L, LUASQL_PREFIX"Unrecognized column type");
+    break;
+  }
+}
+
+
+static void push_column(lua_State *L, sqlite3_stmt *vm, int column) {
+  push_value(L, sqlite3_column_value(vm, column));
+}
+
+
+/*
+** Step the vm of the cursor.
+** The first row is stepped by the execution of the statement, so it is
+** consumed here instead of running the statement again.
+*/
+static int cur_step(cur_data *cur)
+{
+  int res = cur->pending;
+  if (res == 0)
+    return query_step(cur->conn_data, cur->sql_vm, cur->deadline);
+  cur->pending = 0;
+  return res;
+}
+
+
+/*
+** Copy the current row of the cursor to the table at index t.
+** names is the index of the table of column names, or 0 if values
+** should not be copied to alphanumerical indices.
+*/
+static void copy_row(lua_State *L, cur_data *cur, int t, int numeric, int names)
+{
+  sqlite3_stmt *vm = cur->sql_vm;
+  int i;
+
+  if (numeric)
+    {
+      /* Copy values to numerical indices */
+      for (i = 0; i < cur->numcols;)
+        {
+          push_column(L, vm, i);
+          lua_rawseti(L, t, ++i);
+        }
+    }
+  if (names)
+    {
+      /* Copy values to alphanumerical indices */
+      for (i = 0; i < cur->numcols; i++)
+        {
+          lua_rawgeti(L, names, i+1);
+          push_column(L, vm, i);
+          lua_rawset (L, t);
+        }
+    }
+}
+
+
+/*
+** Get another row of the given cursor.
+*/
+static int cur_fetch (lua_State *L) {
+  cur_data *cur = getcursor(L);
+  sqlite3_stmt *vm = cur->sql_vm;
+  int res;
+
+  if (vm == NULL)
+    return 0;
+
+  res = cur_step(cur);
+
+  /* no more results? */
+  if (res == SQLITE_DONE)
+    return finalize(L, cur);
+
+  if (res != SQLITE_ROW)
+    return finalize(L, cur);
+
+  if (lua_istable (L, 2))
+    {
+      const char *opts = luaL_optstring(L, 3, "n");
+      int names = 0;
+
+      if (strchr(opts, 'a') != NULL)
+        {
+          colinfo_push(L, cur->info, vm, 0);
+          names = lua_gettop(L);
+        }
+      copy_row(L, cur, 2, strchr(opts, 'n') != NULL, names);
+      lua_pushvalue(L, 2);
+      return 1; /* return table */
+    }
+  else
+    {
+      int i;
+      luaL_checkstack (L, cur->numcols, LUASQL_PREFIX"too many columns");
+      for (i = 0; i < cur->numcols; ++i)
+        push_column(L, vm, i);
+      return cur->numcols; /* return #numcols values */
+    }
+}
+
+
+/*
+** Get at most max rows (all rows if max < 0) of the given cursor.
+** Return a list of row tables, indexed as in fetch by the string of
+** options at index opts.
+** The cursor is closed when there are no more rows.
+*/
+static int fetch_rows(lua_State *L, cur_data *cur, int max, int opts)
+{
+  const char *mode = luaL_optstring(L, opts, "n");
+  int numeric = strchr(mode, 'n') != NULL;
+  int names = 0;
+  int rows, n = 0;
+  int res = SQLITE_ROW;
+
+  if (strchr(mode, 'a') != NULL)
+    {
+      colinfo_push(L, cur->info, cur->sql_vm, 0);
+      names = lua_gettop(L);
+    }
+  lua_createtable(L, (max >= 0 && max <= 1024) ? max : 0, 0);
+  rows = lua_gettop(L);
+
+  while (n != max && (res = cur_step(cur)) == SQLITE_ROW)
+    {
+      lua_createtable(L, numeric ? cur->numcols : 0, names ? cur->numcols : 0);
+      copy_row(L, cur, lua_gettop(L), numeric, names);
+      lua_rawseti(L, rows, ++n);
+    }
+
+  if (res != SQLITE_ROW)
+    {
+      /* no more results or error */
+      if (cur_release_vm(L, cur) != SQLITE_OK)
+        {
+          res = luasql_faildirect(L, step_errmsg(cur->conn_data));
+          cur_nullify(L, cur);
+          return res;
+        }
+      cur_nullify(L, cur);
+    }
+  lua_pushvalue(L, rows);
+  return 1;
+}
+
+
+/*
+** Get the next n rows of the given cursor.
+*/
+static int cur_fetchmany(lua_State *L)
+{
+  cur_data *cur = getcursor(L);
+  lua_Integer max = luaL_checkinteger(L, 2);
+  /* Lua 5.1 and 5.2 truncate fractional numbers */
+  if (max < 1 || max > INT_MAX || (lua_Number)max != lua_tonumber(L, 2))
+    return luaL_argerror(L, 2, LUASQL_PREFIX"invalid number of rows");
+  return fetch_rows(L, cur, (int)max, 3);
+}
+
+
+/*
+** Get all remaining rows of the given cursor.
+*/
+static int cur_fetchall(lua_State *L)
+{
+  return fetch_rows(L, getcursor(L), -1, 2);
+}
+
+
+/*
+** Cursor object collector function
+*/
+static int cur_gc(lua_State *L)
+{
+  cur_data *cur = (cur_data *)luaL_checkudata(L, 1, LUASQL_CURSOR_SQLITE);
+  if (cur != NULL && !(cur->closed))
+    {
+      cur_release_vm(L, cur);
+      cur_nullify(L, cur);
+    }
+  return 0;
+}
+
+
+/*
+** Close the cursor on top of the stack.
+** Return 1
+*/
+static int cur_close(lua_State *L)
+{
+  cur_data *cur = (cur_data *)luaL_checkudata(L, 1, LUASQL_CURSOR_SQLITE);
+  luaL_argcheck(L, cur != NULL, 1, LUASQL_PREFIX"cursor expected");
+  if (cur->closed) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  cur_release_vm(L, cur);
+  cur_nullify(L, cur);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Return the list of field names.
+*/
+static int cur_getcolnames(lua_State *L)
+{
+  cur_data *cur = getcursor(L);
+  colinfo_pushcopy(L, cur->info, cur->sql_vm, 0);
+  return 1;
+}
+
+
+/*
+** Return the list of field types.
+*/
+static int cur_getcoltypes(lua_State *L)
+{
+  cur_data *cur = getcursor(L);
+  colinfo_pushcopy(L, cur->info, cur->sql_vm, 1);
+  return 1;
+}
+
+
+/*
+** Return a table with the counters of the statement of the cursor,
+** which are kept when the cursor is closed.
+*/
+static int cur_stats(lua_State *L)
+{
+  cur_data *cur = (cur_data *)luaL_checkudata(L, 1, LUASQL_CURSOR_SQLITE);
+  int i;
+  luaL_argcheck(L, cur != NULL, 1, LUASQL_PREFIX"cursor expected");
+  if (!cur->closed)
+    cur_getstats(cur);
+  lua_newtable(L);
+  for (i = 0; stmt_counters[i].name != NULL; i++)
+    {
+      lua_pushinteger(L, cur->stats[i]);
+      lua_setfield(L, -2, stmt_counters[i].name);
+    }
+  return 1;
+}
+
+
+/*
+** Make the cursor use the column information of the statement or cache
+** entry owning its vm, so it is built once for all their cursors.
+** Without the reprepare counter, a change of the columns can not be
+** noticed, so each cursor keeps its own.
+*/
+static void cur_shareinfo(cur_data *cur, col_info *info)
+{
+#ifdef SQLITE_STMTSTATUS_REPREPARE
+  cur->info = info;
+#else
+  (void)cur;
+  (void)info;
+#endif
+}
+
+
+/*
+** Create a new Cursor object and push it on top of the stack.
+*/
+/* static int create_cursor(lua_State *L, int conn, sqlite3_stmt *sql_vm,
+   int numcols, const char **row, const char **col_info)*/
+static int create_cursor(lua_State *L, int o, conn_data *conn,
+			 sqlite3_stmt *sql_vm, int numcols)
+{
+  cur_data *cur = (cur_data*)lua_newuserdata(L, sizeof(cur_data));
+  luasql_setmeta (L, LUASQL_CURSOR_SQLITE);
+
+  /* increment cursor count for the connection creating this cursor */
+  conn->cur_counter++;
+
+  /* fill in structure */
+  cur->closed = 0;
   cur->conn = LUA_NOREF;
+  cur->stmt = LUA_NOREF;
   cur->numcols = numcols;
-  cur->colnames = LUA_NOREF;
-  cur->coltypes = LUA_NOREF;
+  cur->pending = 0;
+  cur->deadline = 0;
+  cur->info = &cur->own_info;
+  cur->own_info.names = cur->own_info.types = LUA_NOREF;
+  cur->own_info.version = 0;
   cur->sql_vm = sql_vm;
   cur->conn_data = conn;
+  cur->stmt_data = NULL;
+  cur->cache_entry = NULL;
+  memset(cur->stats, 0, sizeof(cur->stats));
+
+  lua_pushvalue(L, o);
+  cur->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+
+/*
+** Return the thread used by the connection to call Lua functions from
+** SQLite callbacks, which may run while any coroutine is using the
+** connection.
+*/
+static lua_State *conn_thread(lua_State *L, conn_data *conn)
+{
+  if (conn->L == NULL)
+    {
+      conn->L = lua_newthread(L);
+      conn->thread = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+  return conn->L;
+}
+
+
+#if SQLITE_VERSION_NUMBER >= 3014000
+/*
+** Report a finished statement to the profile function or to the
+** profile ring buffer of the connection.
+*/
+static int profile_callback(unsigned int type, void *ctx, void *p, void *x)
+{
+  conn_data *conn = (conn_data *)ctx;
+  const char *sql = sqlite3_sql((sqlite3_stmt *)p);
+  sqlite3_int64 ns = *(sqlite3_int64 *)x;
+
+  (void)type;
+  if (sql == NULL)
+    sql = "";
+  if (conn->profile_func != LUA_NOREF)
+    {
+      lua_State *L = conn->L;
+      lua_rawgeti(L, LUA_REGISTRYINDEX, conn->profile_func);
+      lua_pushstring(L, sql);
+      lua_pushnumber(L, (lua_Number)ns);
+      if (lua_pcall(L, 2, 0, 0) != 0)
+        lua_pop(L, 1);  /* errors of the profile function are ignored */
+    }
+  else if (conn->profile_ring != NULL)
+    {
+      profile_entry *entry = &conn->profile_ring[conn->profile_next];
+      char *copy = (char *)malloc(strlen(sql) + 1);
+      if (copy == NULL)
+        return 0;
+      strcpy(copy, sql);
+      free(entry->sql);
+      entry->sql = copy;
+      entry->ns = ns;
+      conn->profile_next = (conn->profile_next + 1) % conn->profile_size;
+      if (conn->profile_count < conn->profile_size)
+        conn->profile_count++;
+    }
+  return 0;
+}
+#endif
+
+
+/*
+** Disable profiling and free the profile ring buffer.
+*/
+static void profile_clear(lua_State *L, conn_data *conn)
+{
+  int i;
+#if SQLITE_VERSION_NUMBER >= 3014000
+  sqlite3_trace_v2(conn->sql_conn, 0, NULL, NULL);
+#endif
+  luaL_unref(L, LUA_REGISTRYINDEX, conn->profile_func);
+  conn->profile_func = LUA_NOREF;
+  for (i = 0; i < conn->profile_size; i++)
+    free(conn->profile_ring[i].sql);
+  free(conn->profile_ring);
+  conn->profile_ring = NULL;
+  conn->profile_size = conn->profile_next = conn->profile_count = 0;
+}
+
+
+/*
+** Call the hook function ref of the connection with no arguments.
+** Return whether it returned true; errors are ignored.
+*/
+static int hook_call(conn_data *conn, int ref)
+{
+  lua_State *L = conn->L;
+  int res = 0;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+  if (lua_pcall(L, 0, 1, 0) == 0)
+    res = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return res;
+}
+
+
+/*
+** Update hook: collect the change or pass it to the update function.
+** The function must not use the connection.
+*/
+static void update_hook(void *ctx, int op, const char *db, const char *table,
+			sqlite3_int64 rowid)
+{
+  conn_data *conn = (conn_data *)ctx;
+  lua_State *L = conn->L;
+
+  if (conn->changes_buffered)
+    {
+      changes_add(conn, op, table, rowid);
+      return;
+    }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, conn->update_func);
+  lua_pushstring(L, change_name(op));
+  lua_pushstring(L, db);
+  lua_pushstring(L, table);
+  lua_pushnumber(L, (lua_Number)rowid);
+  if (lua_pcall(L, 4, 0, 0) != 0)
+    lua_pop(L, 1);
+}
+
+
+/*
+** Commit hook: call the commit function, which turns the commit into a
+** rollback by returning true, and mark the collected changes as ready.
+*/
+static int commit_hook(void *ctx)
+{
+  conn_data *conn = (conn_data *)ctx;
+  if (conn->commit_func != LUA_NOREF && hook_call(conn, conn->commit_func))
+    return 1;
+  if (conn->changes_count > 0 || conn->changes_overflow)
+    conn->changes_ready = 1;
+  return 0;
+}
+
+
+/*
+** Rollback hook: call the rollback function and discard the changes of
+** the transaction.
+*/
+static void rollback_hook(void *ctx)
+{
+  conn_data *conn = (conn_data *)ctx;
+  if (conn->rollback_func != LUA_NOREF)
+    hook_call(conn, conn->rollback_func);
+  if (!conn->changes_ready)
+    changes_reset(conn);
+}
+
+
+/*
+** Register the hooks needed by the hook functions of the connection.
+*/
+static void hooks_install(conn_data *conn)
+{
+  sqlite3 *db = conn->sql_conn;
+  int update = (conn->update_func != LUA_NOREF);
+  int buffered = update && conn->changes_buffered;
+  sqlite3_update_hook(db, update ? update_hook : NULL, conn);
+  sqlite3_commit_hook(db, (buffered || conn->commit_func != LUA_NOREF) ?
+		      commit_hook : NULL, conn);
+  sqlite3_rollback_hook(db, (buffered || conn->rollback_func != LUA_NOREF) ?
+			rollback_hook : NULL, conn);
+}
+
+
+/*
+** Remove the update function and free the collected changes.
+*/
+static void changes_clear(lua_State *L, conn_data *conn)
+{
+  changes_reset(conn);
+  free(conn->changes);
+  free(conn->changes_tables);
+  conn->changes = NULL;
+  conn->changes_tables = NULL;
+  conn->changes_size = 0;
+  conn->changes_buffered = 0;
+  conn->changes_limit = 0;
+  luaL_unref(L, LUA_REGISTRYINDEX, conn->update_func);
+  conn->update_func = LUA_NOREF;
+}
+
+
+/*
+** Remove all hook functions of the connection.
+*/
+static void hooks_clear(lua_State *L, conn_data *conn)
+{
+  changes_clear(L, conn);
+  luaL_unref(L, LUA_REGISTRYINDEX, conn->commit_func);
+  luaL_unref(L, LUA_REGISTRYINDEX, conn->rollback_func);
+  conn->commit_func = conn->rollback_func = LUA_NOREF;
+  hooks_install(conn);
+}
+
+
+/*
+** Connection object collector function
+*/
+static int conn_gc(lua_State *L)
+{
+  conn_data *conn = (conn_data *)luaL_checkudata(L, 1, LUASQL_CONNECTION_SQLITE);
+  if (conn != NULL && !(conn->closed))
+    {
+      if (conn->cur_counter > 0)
+        return luaL_error (L, LUASQL_PREFIX"there are open cursors");
+      if (conn->stmt_counter > 0)
+        return luaL_error (L, LUASQL_PREFIX"there are open statements");
+      if (conn->blob_counter > 0)
+        return luaL_error (L, LUASQL_PREFIX"there are open blobs");
+
+      /* Nullify structure fields. */
+      conn->closed = 1;
+      luaL_unref(L, LUA_REGISTRYINDEX, conn->env);
+      group_flush(conn);
+      profile_clear(L, conn);
+      hooks_clear(L, conn);
+      cache_clear(L, conn);
+      tx_clear(conn);
+      sqlite3_close(conn->sql_conn);
+      luaL_unref(L, LUA_REGISTRYINDEX, conn->thread);
+    }
+  return 0;
+}
+
+
+/*
+** Close a Connection object.
+*/
+static int conn_close(lua_State *L)
+{
+  conn_data *conn = (conn_data *)luaL_checkudata(L, 1, LUASQL_CONNECTION_SQLITE);
+  luaL_argcheck (L, conn != NULL, 1, LUASQL_PREFIX"connection expected");
+  if (conn->closed)
+    {
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+  if (conn->cur_counter == 0 && group_flush(conn) != SQLITE_OK)
+    {
+      /* the batch is rolled back by closing the connection */
+      int res = luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+      conn_gc(L);
+      return res;
+    }
+  conn_gc(L);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int conn_escape(lua_State *L)
+{
+  const char *from = luaL_checklstring (L, 2, 0);
+  char *escaped = sqlite3_mprintf("%q", from);
+  if (escaped == NULL)
+    {
+      lua_pushnil(L);
+    }
+  else
+    {
+      lua_pushstring(L, escaped);
+      sqlite3_free(escaped);
+    }
+  return 1;
+}
+
+/*
+** Get the compiled statement of the given SQL text, from the cache or
+** compiling it, and its cache entry.
+*/
+static int get_vm(conn_data *conn, const char *statement, size_t len,
+		  sqlite3_stmt **vm, cache_entry **entry)
+{
+  int res;
+  *entry = cache_get(conn, statement, len);
+  if (*entry != NULL)
+    {
+      *vm = (*entry)->sql_vm;
+      return SQLITE_OK;
+    }
+  res = sql_prepare(conn, statement, conn->cache_capacity > 0, vm, NULL);
+  if (res == SQLITE_OK)
+    *entry = cache_newentry(conn, statement, len, *vm);
+  return res;
+}
+
+
+/*
+** Execute a compiled statement of the connection at index o.
+** Return a Cursor object if the statement is a query, otherwise
+** return the number of tuples affected by the statement.
+*/
+static int execute_vm(lua_State *L, int o, conn_data *conn, cache_entry *entry,
+		      sqlite3_stmt *vm)
+{
+  int res;
+  int numcols;
+  int lost;
+  sqlite3_int64 deadline = query_deadline(conn);
+
+  /* process first result to retrive query information and type;
+     a query keeps it as the first row of its cursor */
+  stmt_resetstats(vm);
+  group_before(conn, vm);
+  res = query_step(conn, vm, deadline);
+  lost = group_after(conn, vm, res);
+  numcols = sqlite3_column_count(vm);
+
+  /* real query? if empty, must have numcols!=0 */
+  if ((res == SQLITE_ROW) || ((res == SQLITE_DONE) && numcols))
+    {
+      cur_data *cur;
+      create_cursor(L, o, conn, vm, numcols);
+      cur = (cur_data *)lua_touserdata(L, -1);
+      cur->cache_entry = entry;
+      if (entry != NULL)
+        cur_shareinfo(cur, &entry->info);
+      cur->pending = res;
+      cur->deadline = deadline;
+      return 1;
+    }
+
+  if (res == SQLITE_DONE) /* and numcols==0, INSERT,UPDATE,DELETE statement */
+    {
+      release_vm(L, conn, entry, vm);
+      /* return number of columns changed */
+      lua_pushnumber(L, sqlite3_changes(conn->sql_conn));
+      return 1;
+    }
+
+  /* error */
+  res = group_fail(L, conn, lost);
+  release_vm(L, conn, entry, vm);
+  return res;
+}
+
+
+/*
+** Execute an SQL statement.
+** Return a Cursor object if the statement is a query, otherwise
+** return the number of tuples affected by the statement.
+*/
+static int conn_execute(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  size_t len;
+  const char *statement = luaL_checklstring(L, 2, &len);
+  cache_entry *entry;
+  sqlite3_stmt *vm;
+
+  if (get_vm(conn, statement, len, &vm, &entry) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  return execute_vm(L, 1, conn, entry, vm);
+}
+
+
+/*
+** Execute all the statements of an SQL script, discarding the rows of
+** queries, optionally inside a single transaction.
+** Return the number of rows changed by the script, or nil, the error
+** message and the position in the script of the statement that failed.
+*/
+static int conn_execscript(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *script = luaL_checkstring(L, 2);
+  int transaction = lua_istable(L, 3) && opt_boolean(L, 3, "transaction", 0);
+  int nested = !sqlite3_get_autocommit(conn->sql_conn);
+  int before, res = SQLITE_OK;
+  const char *sql = script;
+  sqlite3_stmt *vm;
+
+  if (group_flush(conn) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  if (transaction && batch_begin(conn, nested) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+
+  before = sqlite3_total_changes(conn->sql_conn);
+  conn->timed_out = 0;
+  while (*sql != '\0')
+    {
+      const char *tail;
+      if (isspace((unsigned char)*sql))
+        {
+          sql++;
+          continue;
+        }
+      res = sql_prepare(conn, sql, 0, &vm, &tail);
+      if (res != SQLITE_OK)
+        break;
+      if (vm != NULL)  /* not only spaces or comments */
+        {
+          sqlite3_int64 deadline = query_deadline(conn);
+          while ((res = query_step(conn, vm, deadline)) == SQLITE_ROW)
+            ;
+          sqlite3_finalize(vm);
+          if (res != SQLITE_DONE)
+            break;
+          res = SQLITE_OK;
+        }
+      sql = tail;
+    }
+
+  if (res != SQLITE_OK)
+    {
+      luasql_faildirect(L, step_errmsg(conn));
+      lua_pushinteger(L, (lua_Integer)(sql - script) + 1);
+      if (transaction)
+        batch_end(conn, nested, 0);
+      return 3;
+    }
+  if (transaction && batch_end(conn, nested, 1) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  lua_pushnumber(L, sqlite3_total_changes(conn->sql_conn) - before);
+  return 1;
+}
+
+
+/*
+** Check whether the number at index idx is an integer, which is kept
+** as INTEGER, like push_value reads them.
+*/
+static int tointeger(lua_State *L, int idx, sqlite3_int64 *i)
+{
+#if LUA_VERSION_NUM >= 503
+  if (!lua_isinteger(L, idx))
+    return 0;
+  *i = lua_tointeger(L, idx);
+  return 1;
+#else
+  lua_Number n = lua_tonumber(L, idx);
+  if (n < -9007199254740992.0 || n > 9007199254740992.0 ||
+      n != (lua_Number)(sqlite3_int64)n)
+    return 0;
+  *i = (sqlite3_int64)n;
+  return 1;
+#endif
+}
+
+
+/*
+** Binds the value at index idx of the stack to the parameter #i of vm.
+*/
+static int bind_value(lua_State *L, sqlite3_stmt *vm, int i, int idx)
+{
+  switch (lua_type(L, idx)) {
+  case LUA_TNONE:
+  case LUA_TNIL:
+    return sqlite3_bind_null(vm, i);
+  case LUA_TBOOLEAN:
+    return sqlite3_bind_int(vm, i, lua_toboolean(L, idx));
+  case LUA_TNUMBER:
+    {
+      sqlite3_int64 n;
+      if (tointeger(L, idx, &n))
+	return sqlite3_bind_int64(vm, i, n);
+      return sqlite3_bind_double(vm, i, lua_tonumber(L, idx));
+    }
+  case LUA_TSTRING:
+    {
+      size_t len;
+      const char *s = lua_tolstring(L, idx, &len);
+      return sqlite3_bind_text(vm, i, s, (int)len, SQLITE_TRANSIENT);
+    }
+  default:
+    return luaL_error(L, LUASQL_PREFIX"cannot bind a %s value to parameter %d",
+		      luaL_typename(L, idx), i);
+  }
+}
+
+
+/*
+** Binds the parameters of vm to the values starting at index first.
+** If that value is a table, it provides the values of both positional
+** (array part) and named (string keys without the ':', '@' or '$'
+** prefix) parameters.
+** Parameters without a value are bound to NULL.
+*/
+static int bind_params(lua_State *L, sqlite3_stmt *vm, int first)
+{
+  int i, res = SQLITE_OK;
+  int top = lua_gettop(L);
+
+  sqlite3_clear_bindings(vm);
+  if (top == first && lua_istable(L, first))
+    {
+      int nparams = sqlite3_bind_parameter_count(vm);
+      for (i = 1; i <= nparams && res == SQLITE_OK; i++)
+        {
+          const char *name = sqlite3_bind_parameter_name(vm, i);
+          lua_pushnil(L);
+          if (name != NULL && name[0] != '?')
+            {
+              lua_pop(L, 1);
+              lua_getfield(L, first, name+1);
+            }
+          if (lua_isnil(L, -1))
+            {
+              lua_pop(L, 1);
+              lua_rawgeti(L, first, i);
+            }
+          res = bind_value(L, vm, i, lua_gettop(L));
+          lua_pop(L, 1);
+        }
+    }
+  else
+    {
+      for (i = first; i <= top && res == SQLITE_OK; i++)
+        res = bind_value(L, vm, i-first+1, i);
+    }
+  return res;
+}
+
+
+/*
+** Bind and execute the statement for each row of a list or iterator.
+** Stops at the first error, which is left in bulk->res.
+*/
+static int bulk_rows(lua_State *L)
+{
+  bulk_data *bulk = (bulk_data *)lua_touserdata(L, 1);
+  int iterator = lua_isfunction(L, 2);
+
+  for (;;)
+    {
+      if (iterator)
+        {
+          lua_pushvalue(L, 2);
+          lua_call(L, 0, 1);
+        }
+      else
+        lua_rawgeti(L, 2, bulk->n + 1);
+      if (lua_isnil(L, -1))
+        return 0;
+      bulk->n++;
+      sqlite3_reset(bulk->vm);
+      bulk->res = bind_params(L, bulk->vm, 3);
+      lua_settop(L, 2);
+      if (bulk->res != SQLITE_OK)
+        return 0;
+      while ((bulk->res = query_step(bulk->conn, bulk->vm, bulk->deadline)) == SQLITE_ROW)
+        ;
+      if (bulk->res != SQLITE_DONE)
+        return 0;
+      bulk->res = SQLITE_OK;
+      bulk->changes += sqlite3_changes(bulk->conn->sql_conn);
+    }
+}
+
+
+/*
+** Execute an SQL statement once for each row of parameters, given by
+** a list or an iterator function, optionally inside a single transaction.
+** Return the number of rows changed, or nil, the error message and the
+** number of the row that failed.
+*/
+static int conn_executemany(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  size_t len;
+  const char *statement = luaL_checklstring(L, 2, &len);
+  int transaction = lua_istable(L, 4) && opt_boolean(L, 4, "transaction", 0);
+  int nested = !sqlite3_get_autocommit(conn->sql_conn);
+  cache_entry *entry;
+  bulk_data bulk;
+  int status;
+
+  if (!lua_isfunction(L, 3))
+    luaL_checktype(L, 3, LUA_TTABLE);
+  if (group_flush(conn) != SQLITE_OK ||
+      get_vm(conn, statement, len, &bulk.vm, &entry) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  if (bulk.vm == NULL)  /* no statement */
+    {
+      lua_pushnumber(L, 0);
+      return 1;
+    }
+  if (transaction && batch_begin(conn, nested) != SQLITE_OK)
+    {
+      int res = luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+      release_vm(L, conn, entry, bulk.vm);
+      return res;
+    }
+
+  bulk.conn = conn;
+  bulk.deadline = query_deadline(conn);
+  bulk.n = 0;
+  bulk.res = SQLITE_OK;
+  bulk.changes = 0;
+  lua_pushcfunction(L, bulk_rows);
+  lua_pushlightuserdata(L, &bulk);
+  lua_pushvalue(L, 3);
+  status = lua_pcall(L, 2, 0, 0);
+
+  if (status != 0 || bulk.res != SQLITE_OK)
+    {
+      if (status == 0)
+        {
+          luasql_faildirect(L, step_errmsg(conn));
+          lua_pushinteger(L, bulk.n);
+        }
+      sqlite3_clear_bindings(bulk.vm);
+      release_vm(L, conn, entry, bulk.vm);
+      if (transaction)
+        batch_end(conn, nested, 0);
+      if (status != 0)
+        return lua_error(L);  /* error raised by the rows or the iterator */
+      return 3;
+    }
+  sqlite3_clear_bindings(bulk.vm);
+  release_vm(L, conn, entry, bulk.vm);
+  if (transaction && batch_end(conn, nested, 1) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  lua_pushnumber(L, bulk.changes);
+  return 1;
+}
+
+
+/*
+** Closes the statement and nullify all structure fields.
+*/
+static void stmt_nullify(lua_State *L, stmt_data *stmt)
+{
+  stmt->closed = 1;
+  sqlite3_finalize(stmt->sql_vm);
+  stmt->sql_vm = NULL;
+  colinfo_clear(L, &stmt->info);
+  stmt->conn_data->stmt_counter--;
+  luaL_unref(L, LUA_REGISTRYINDEX, stmt->conn);
+}
+
+
+/*
+** Bind values to the parameters of a statement.
+*/
+static int stmt_bind(lua_State *L)
+{
+  stmt_data *stmt = getstatement(L);
+  if (stmt->busy)
+    return luaL_error(L, LUASQL_PREFIX"there are open cursors");
+
+  sqlite3_reset(stmt->sql_vm);
+  if (bind_params(L, stmt->sql_vm, 2) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(stmt->conn_data->sql_conn));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Execute a prepared statement, binding its parameters to the given
+** values, if any, or keeping the current bindings otherwise.
+** Return a Cursor object if the statement is a query, otherwise
+** return the number of tuples affected by the statement.
+*/
+static int stmt_execute(lua_State *L)
+{
+  stmt_data *stmt = getstatement(L);
+  conn_data *conn = stmt->conn_data;
+  sqlite3_stmt *vm = stmt->sql_vm;
+  int res;
+  int numcols;
+  int lost;
+  sqlite3_int64 deadline;
+
+  if (stmt->busy)
+    return luaL_error(L, LUASQL_PREFIX"there are open cursors");
+
+  sqlite3_reset(vm);
+  if (lua_gettop(L) > 1 && bind_params(L, vm, 2) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+
+  deadline = query_deadline(conn);
+  stmt_resetstats(vm);
+  group_before(conn, vm);
+  res = query_step(conn, vm, deadline);
+  lost = group_after(conn, vm, res);
+  numcols = sqlite3_column_count(vm);
+
+  if ((res == SQLITE_ROW) || ((res == SQLITE_DONE) && numcols))
+    {
+      cur_data *cur;
+      lua_rawgeti(L, LUA_REGISTRYINDEX, stmt->conn);
+      create_cursor(L, lua_gettop(L), conn, vm, numcols);
+      cur = (cur_data *)lua_touserdata(L, -1);
+      cur->stmt_data = stmt;
+      cur_shareinfo(cur, &stmt->info);
+      cur->pending = res;
+      cur->deadline = deadline;
+      lua_pushvalue(L, 1);
+      cur->stmt = luaL_ref(L, LUA_REGISTRYINDEX);
+      stmt->busy = 1;
+      return 1;
+    }
+
+  if (res == SQLITE_DONE)
+    {
+      sqlite3_reset(vm);
+      lua_pushnumber(L, sqlite3_changes(conn->sql_conn));
+      return 1;
+    }
+
+  /* error */
+  res = group_fail(L, conn, lost);
+  sqlite3_reset(vm);
+  return res;
+}
+
+
+/*
+** Statement object collector function
+*/
+static int stmt_gc(lua_State *L)
+{
+  stmt_data *stmt = (stmt_data *)luaL_checkudata(L, 1, LUASQL_STATEMENT_SQLITE);
+  if (stmt != NULL && !(stmt->closed))
+    stmt_nullify(L, stmt);
+  return 0;
+}
+
+
+/*
+** Close the statement on top of the stack.
+** Return true in case of success, or false in case the statement was
+** already closed.
+*/
+static int stmt_close(lua_State *L)
+{
+  stmt_data *stmt = (stmt_data *)luaL_checkudata(L, 1, LUASQL_STATEMENT_SQLITE);
+  luaL_argcheck(L, stmt != NULL, 1, LUASQL_PREFIX"statement expected");
+  if (stmt->closed)
+    {
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+  if (stmt->busy)
+    return luaL_error(L, LUASQL_PREFIX"there are open cursors");
+  stmt_nullify(L, stmt);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Prepare an SQL statement for repeated execution.
+** Return a Statement object.
+*/
+static int conn_prepare(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *statement = luaL_checkstring(L, 2);
+  sqlite3_stmt *vm;
+  stmt_data *stmt;
+
+  if (sql_prepare(conn, statement, 1, &vm, NULL) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  if (vm == NULL)
+    return luasql_faildirect(L, "empty statement");
+
+  stmt = (stmt_data *)lua_newuserdata(L, sizeof(stmt_data));
+  luasql_setmeta(L, LUASQL_STATEMENT_SQLITE);
+
+  /* fill in structure */
+  stmt->closed = 0;
+  stmt->busy = 0;
+  stmt->conn = LUA_NOREF;
+  stmt->conn_data = conn;
+  stmt->sql_vm = vm;
+  stmt->info.names = stmt->info.types = LUA_NOREF;
+  stmt->info.version = 0;
+  conn->stmt_counter++;
+  lua_pushvalue(L, 1);
+  stmt->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+
+/*
+** Closes the blob and nullify all structure fields.
+*/
+static int blob_nullify(lua_State *L, blob_data *blob)
+{
+  int res = sqlite3_blob_close(blob->blob);
+  blob->closed = 1;
+  blob->blob = NULL;
+  blob->conn_data->blob_counter--;
+  luaL_unref(L, LUA_REGISTRYINDEX, blob->conn);
+  return res;
+}
+
+
+/*
+** Return the offset given at index idx or the current one.
+*/
+static int blob_offset(lua_State *L, blob_data *blob, int idx)
+{
+  int offset = (int)luaL_optnumber(L, idx, blob->pos);
+  luaL_argcheck(L, offset >= 0 && offset <= sqlite3_blob_bytes(blob->blob),
+		idx, LUASQL_PREFIX"offset out of range");
+  return offset;
+}
+
+
+/*
+** Read at most n bytes of the blob, starting at the given offset or
+** after the last byte read or written.
+** Return the bytes read or nil at the end of the blob.
+*/
+static int blob_read(lua_State *L)
+{
+  blob_data *blob = getblob(L);
+  int n = (int)luaL_checknumber(L, 2);
+  int offset = blob_offset(L, blob, 3);
+  int size = sqlite3_blob_bytes(blob->blob);
+  luaL_Buffer b;
+
+  luaL_argcheck(L, n >= 0, 2, LUASQL_PREFIX"invalid number of bytes");
+  if (offset >= size && n > 0)
+    {
+      lua_pushnil(L);
+      return 1;
+    }
+  if (n > size - offset)
+    n = size - offset;
+
+  luaL_buffinit(L, &b);
+  blob->pos = offset;
+  while (n > 0)
+    {
+      int chunk = n > LUAL_BUFFERSIZE ? LUAL_BUFFERSIZE : n;
+      if (sqlite3_blob_read(blob->blob, luaL_prepbuffer(&b), chunk, blob->pos) != SQLITE_OK)
+        return luasql_faildirect(L, sqlite3_errmsg(blob->conn_data->sql_conn));
+      luaL_addsize(&b, chunk);
+      blob->pos += chunk;
+      n -= chunk;
+    }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+
+/*
+** Write the given string to the blob, starting at the given offset or
+** after the last byte read or written.
+** The size of a blob can not be changed.
+*/
+static int blob_write(lua_State *L)
+{
+  blob_data *blob = getblob(L);
+  size_t len;
+  const char *data = luaL_checklstring(L, 2, &len);
+  int offset = blob_offset(L, blob, 3);
+
+  if (sqlite3_blob_write(blob->blob, data, (int)len, offset) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(blob->conn_data->sql_conn));
+  blob->pos = offset + (int)len;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Return the size of the blob in bytes.
+*/
+static int blob_size(lua_State *L)
+{
+  lua_pushinteger(L, sqlite3_blob_bytes(getblob(L)->blob));
+  return 1;
+}
+
+
+/*
+** Return the rowid at index idx, checked as an integer in Lua 5.3 and
+** later so rowids above 2^53 are kept exact.
+*/
+static sqlite3_int64 check_rowid(lua_State *L, int idx)
+{
+#if LUA_VERSION_NUM >= 503
+  return (sqlite3_int64)luaL_checkinteger(L, idx);
+#else
+  return (sqlite3_int64)luaL_checknumber(L, idx);
+#endif
+}
+
+
+#if SQLITE_VERSION_NUMBER >= 3007004
+/*
+** Move the blob to another row of the same table.
+*/
+static int blob_reopen(lua_State *L)
+{
+  blob_data *blob = getblob(L);
+  sqlite3_int64 rowid = check_rowid(L, 2);
+
+  if (sqlite3_blob_reopen(blob->blob, rowid) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(blob->conn_data->sql_conn));
+  blob->pos = 0;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+#endif
+
+
+/*
+** Blob object collector function
+*/
+static int blob_gc(lua_State *L)
+{
+  blob_data *blob = (blob_data *)luaL_checkudata(L, 1, LUASQL_BLOB_SQLITE);
+  if (blob != NULL && !(blob->closed))
+    blob_nullify(L, blob);
+  return 0;
+}
+
+
+/*
+** Close the blob on top of the stack.
+** Return true in case of success, or false in case the blob was
+** already closed.
+*/
+static int blob_close(lua_State *L)
+{
+  blob_data *blob = (blob_data *)luaL_checkudata(L, 1, LUASQL_BLOB_SQLITE);
+  luaL_argcheck(L, blob != NULL, 1, LUASQL_PREFIX"blob expected");
+  if (blob->closed)
+    {
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+  if (blob_nullify(L, blob) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(blob->conn_data->sql_conn));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Open a BLOB (or TEXT) value for incremental I/O.
+** Return a Blob object.
+*/
+static int conn_openblob(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *table = luaL_checkstring(L, 2);
+  const char *column = luaL_checkstring(L, 3);
+  sqlite3_int64 rowid = check_rowid(L, 4);
+  int writable = lua_toboolean(L, 5);
+  const char *db = luaL_optstring(L, 6, "main");
+  sqlite3_blob *handle;
+  blob_data *blob;
+
+  if (sqlite3_blob_open(conn->sql_conn, db, table, column, rowid, writable,
+			&handle) != SQLITE_OK)
+    {
+      int res = luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+      sqlite3_blob_close(handle);
+      return res;
+    }
+
+  blob = (blob_data *)lua_newuserdata(L, sizeof(blob_data));
+  luasql_setmeta(L, LUASQL_BLOB_SQLITE);
+
+  /* fill in structure */
+  blob->closed = 0;
+  blob->conn = LUA_NOREF;
+  blob->pos = 0;
+  blob->conn_data = conn;
+  blob->blob = handle;
+  conn->blob_counter++;
+  lua_pushvalue(L, 1);
+  blob->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+
+/*
+** Copy a database of the connection to another connection or to a
+** file, copying the given number of pages at each step so the source
+** database is not locked for the whole copy.
+** Locked databases are waited for up to the given number of
+** milliseconds, by default the timeout of the busy handler.
+*/
+static int conn_backup_to(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  int pages = (int)luaL_optnumber(L, 3, -1);
+  const char *dbname = luaL_optstring(L, 4, "main");
+  int timeout = (int)luaL_optnumber(L, 5, conn->busy_timeout > 0 ?
+				    conn->busy_timeout : LUASQL_SQLITE_BACKUP_TIMEOUT);
+  const char *path = NULL;
+  sqlite3 *dest;
+  sqlite3_backup *backup;
+  sqlite3_int64 deadline;
+  int res;
+
+  if (lua_type(L, 2) == LUA_TSTRING)
+    path = lua_tostring(L, 2);
+  else
+    {
+      conn_data *other = (conn_data *)luaL_checkudata(L, 2, LUASQL_CONNECTION_SQLITE);
+      luaL_argcheck(L, other != NULL, 2, LUASQL_PREFIX"connection expected");
+      luaL_argcheck(L, !other->closed, 2, LUASQL_PREFIX"connection is closed");
+      if (group_flush(other) != SQLITE_OK)
+        return luasql_faildirect(L, sqlite3_errmsg(other->sql_conn));
+      dest = other->sql_conn;
+    }
+  if (group_flush(conn) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  if (path != NULL && sqlite3_open(path, &dest) != SQLITE_OK)
+    {
+      res = luasql_faildirect(L, sqlite3_errmsg(dest));
+      sqlite3_close(dest);
+      return res;
+    }
+
+  backup = sqlite3_backup_init(dest, "main", conn->sql_conn, dbname);
+  deadline = now_ms() + timeout;
+  if (backup == NULL)
+    res = SQLITE_ERROR;
+  else
+    {
+      for (;;)
+        {
+          res = sqlite3_backup_step(backup, pages);
+          if (res == SQLITE_BUSY || res == SQLITE_LOCKED)
+            {
+              if (now_ms() >= deadline)
+                break;
+              sqlite3_sleep(LUASQL_SQLITE_BACKUP_SLEEP);
+            }
+          else if (res != SQLITE_OK)
+            break;
+        }
+      if (res == SQLITE_DONE)
+        res = sqlite3_backup_finish(backup);
+      else
+        sqlite3_backup_finish(backup);
+    }
+
+  if (res == SQLITE_BUSY || res == SQLITE_LOCKED)
+    res = luasql_faildirect(L, sqlite3_errstr(res));
+  else if (res != SQLITE_OK)
+    res = luasql_faildirect(L, sqlite3_errmsg(dest));
+  else
+    {
+      lua_pushboolean(L, 1);
+      res = 1;
+    }
+  if (path != NULL)
+    sqlite3_close(dest);
+  return res;
+}
+
+
+/*
+** Modes of conn:checkpoint.
+*/
+static const char *const checkpoint_modes[] = {
+  "passive", "full", "restart",
+#ifdef SQLITE_CHECKPOINT_TRUNCATE
+  "truncate",
+#endif
+  NULL
+};
+static const int checkpoint_ops[] = {
+  SQLITE_CHECKPOINT_PASSIVE, SQLITE_CHECKPOINT_FULL, SQLITE_CHECKPOINT_RESTART,
+#ifdef SQLITE_CHECKPOINT_TRUNCATE
+  SQLITE_CHECKPOINT_TRUNCATE,
+#endif
+};
+
+
+/*
+** Copy the frames of the write-ahead log back into a database of the
+** connection (all of them by default), in the given mode.
+** Return the number of frames in the log and of frames checkpointed.
+*/
+static int conn_checkpoint(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  int mode = luaL_checkoption(L, 2, "passive", checkpoint_modes);
+  const char *dbname = luaL_optstring(L, 3, NULL);
+  int log = 0, done = 0;
+
+  if (group_flush(conn) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  if (sqlite3_wal_checkpoint_v2(conn->sql_conn, dbname, checkpoint_ops[mode],
+				&log, &done) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  lua_pushnumber(L, log);
+  lua_pushnumber(L, done);
+  return 2;
+}
+
+
+/*
+** Set the number of frames of the write-ahead log which makes a commit
+** run a passive checkpoint. Zero or a negative value disables it.
+*/
+static int conn_setautocheckpoint(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  int frames = (int)luaL_checknumber(L, 2);
+  if (sqlite3_wal_autocheckpoint(conn->sql_conn, frames) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Run PRAGMA optimize and, if a number of pages is given, release up to
+** that many free pages of a database in incremental vacuum mode.
+*/
+static int conn_optimize(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  int pages = (int)luaL_optnumber(L, 2, 0);
+  int res;
+
+  if (group_flush(conn) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  res = sqlite3_exec(conn->sql_conn, "PRAGMA optimize", NULL, NULL, NULL);
+  if (res == SQLITE_OK && pages > 0)
+    {
+      char *sql = sqlite3_mprintf("PRAGMA incremental_vacuum(%d)", pages);
+      res = (sql == NULL) ? SQLITE_NOMEM :
+	sqlite3_exec(conn->sql_conn, sql, NULL, NULL, NULL);
+      sqlite3_free(sql);
+    }
+  if (res != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+#if SQLITE_VERSION_NUMBER >= 3036000 || defined(SQLITE_ENABLE_DESERIALIZE)
+/*
+** Return the contents of a database of the connection as a string.
+*/
+static int conn_serialize(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *dbname = luaL_optstring(L, 2, "main");
+  sqlite3_int64 size = -1;
+  unsigned char *data;
+
+  if (group_flush(conn) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  data = sqlite3_serialize(conn->sql_conn, dbname, &size, 0);
+  if (data == NULL)
+    {
+      if (size != 0)
+        return luasql_faildirect(L, "could not serialize database");
+      lua_pushliteral(L, "");  /* empty database */
+      return 1;
+    }
+  lua_pushlstring(L, (const char *)data, (size_t)size);
+  sqlite3_free(data);
+  return 1;
+}
+
+
+/*
+** Replace a database of the connection by an in-memory copy of the
+** given contents, as returned by conn:serialize.
+*/
+static int conn_deserialize(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  size_t size;
+  const char *bytes = luaL_checklstring(L, 2, &size);
+  const char *dbname = luaL_optstring(L, 3, "main");
+  unsigned int flags = SQLITE_DESERIALIZE_FREEONCLOSE;
+  unsigned char *data;
+  int res;
+
+  flags |= lua_toboolean(L, 4) ? SQLITE_DESERIALIZE_READONLY : SQLITE_DESERIALIZE_RESIZEABLE;
+  if (group_flush(conn) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  data = (unsigned char *)sqlite3_malloc64(size > 0 ? size : 1);
+  if (data == NULL)
+    return luasql_faildirect(L, sqlite3_errstr(SQLITE_NOMEM));
+  memcpy(data, bytes, size);
+
+  /* data is freed by SQLite, even in case of error */
+  res = sqlite3_deserialize(conn->sql_conn, dbname, data, size, size, flags);
+  if (res != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errstr(res));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+#endif
+
+
+/*
+** Commit the current transaction.
+*/
+static int conn_commit(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+
+  if (conn->group_open)
+    {
+      /* in autocommit mode, only the group commit batch is pending */
+      if (group_flush(conn) != SQLITE_OK)
+        return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+      lua_pushboolean(L, 1);
+      return 1;
+    }
+
+  if (tx_exec(conn, TX_COMMIT) != SQLITE_OK ||
+      (conn->auto_commit == 0 && tx_exec(conn, TX_BEGIN) != SQLITE_OK))
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Rollback the current transaction.
+*/
+static int conn_rollback(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+
+  group_flush(conn);  /* writes in autocommit mode are not undone */
+  if (tx_exec(conn, TX_ROLLBACK) != SQLITE_OK ||
+      (conn->auto_commit == 0 && tx_exec(conn, TX_BEGIN) != SQLITE_OK))
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int conn_getlastautoid(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  lua_pushnumber(L, sqlite3_last_insert_rowid(conn->sql_conn));
+  return 1;
+}
 
-  lua_pushvalue(L, o);
-  cur->conn = luaL_ref(L, LUA_REGISTRYINDEX);
 
-  /* create table with column names */
+/*
+** Set the maximum number of idle statements kept by the connection.
+** Zero disables the statement cache.
+*/
+static int conn_setcachesize(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  int capacity = (int)luaL_checknumber(L, 2);
+  if (!cache_resize(L, conn, capacity))
+    return luasql_faildirect(L, "not enough memory");
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Return a table with the counters of the statement cache.
+*/
+static int conn_cachestats(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
   lua_newtable(L);
-  for (i = 0; i < numcols;)
+  lua_pushnumber(L, conn->cache_hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, conn->cache_misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushnumber(L, conn->cache_evictions);
+  lua_setfield(L, -2, "evictions");
+  lua_pushinteger(L, conn->cache_size);
+  lua_setfield(L, -2, "size");
+  lua_pushinteger(L, conn->cache_capacity);
+  lua_setfield(L, -2, "capacity");
+  return 1;
+}
+
+
+/*
+** Configure group commit: in autocommit mode, consecutive writes are
+** executed in a single transaction, committed after the given number
+** of statements or milliseconds.
+** A false or nil value commits the open batch and disables it.
+*/
+static int conn_setgroupcommit(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  if (group_configure(L, conn, 2) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Commit the open group commit batch, if any.
+*/
+static int conn_flush(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  if (group_flush(conn) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Configure the busy handler of the connection, which retries a locked
+** operation with a jittered exponential backoff until a deadline.
+** A false or nil value removes it, so locks fail immediately.
+*/
+static int conn_setbusyhandler(lua_State *L)
+{
+  busy_configure(L, getconnection(L), 2);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Return a table with the counters of the busy handler.
+*/
+static int conn_busystats(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  lua_newtable(L);
+  lua_pushnumber(L, conn->busy_events);
+  lua_setfield(L, -2, "events");
+  lua_pushnumber(L, conn->busy_retries);
+  lua_setfield(L, -2, "retries");
+  lua_pushnumber(L, conn->busy_failures);
+  lua_setfield(L, -2, "failures");
+  lua_pushnumber(L, conn->busy_waited);
+  lua_setfield(L, -2, "waited");
+  return 1;
+}
+
+
+/*
+** Return a table with the memory and cache counters of the connection.
+** If the argument is true, the cache counters are reset.
+*/
+static int conn_dbstatus(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  int reset = lua_toboolean(L, 2);
+  int i;
+
+  lua_newtable(L);
+  for (i = 0; db_counters[i].name != NULL; i++)
     {
-      lua_pushstring(L, sqlite3_column_name(sql_vm, i));
-      lua_rawseti(L, -2, ++i);
+      int current = 0, highwater = 0;
+      sqlite3_db_status(conn->sql_conn, db_counters[i].op, &current, &highwater, reset);
+      lua_pushnumber(L, current);
+      lua_setfield(L, -2, db_counters[i].name);
     }
-  cur->colnames = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
 
-  /* create table with column types */
+/*
+** Return a table with the counters of group commit.
+*/
+static int conn_groupstats(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
   lua_newtable(L);
-  for (i = 0; i < numcols;)
+  lua_pushnumber(L, conn->group_flushes);
+  lua_setfield(L, -2, "flushes");
+  lua_pushnumber(L, conn->group_writes);
+  lua_setfield(L, -2, "writes");
+  lua_pushinteger(L, conn->group_largest);
+  lua_setfield(L, -2, "largest");
+  lua_pushnumber(L, conn->group_flushes > 0 ? conn->group_writes / conn->group_flushes : 0);
+  lua_setfield(L, -2, "average");
+  lua_pushinteger(L, conn->group_count);
+  lua_setfield(L, -2, "pending");
+  return 1;
+}
+
+
+#if SQLITE_VERSION_NUMBER >= 3014000
+/*
+** Profile the statements of the connection, calling the given function
+** with the SQL text and the run time in nanoseconds of each one, or
+** keeping the last n of them in a ring buffer. False disables it.
+*/
+static int conn_setprofile(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+
+  profile_clear(L, conn);
+  if (lua_isfunction(L, 2))
     {
-      lua_pushstring(L, sqlite3_column_decltype(sql_vm, i));
-      lua_rawseti(L, -2, ++i);
+      conn_thread(L, conn);
+      lua_pushvalue(L, 2);
+      conn->profile_func = luaL_ref(L, LUA_REGISTRYINDEX);
     }
-  cur->coltypes = luaL_ref(L, LUA_REGISTRYINDEX);
-
+  else if (lua_toboolean(L, 2))
+    {
+      int size = (int)luaL_checknumber(L, 2);
+      luaL_argcheck(L, size > 0, 2, LUASQL_PREFIX"invalid profile size");
+      conn->profile_ring = (profile_entry *)calloc(size, sizeof(profile_entry));
+      if (conn->profile_ring == NULL)
+        return luasql_faildirect(L, "out of memory");
+      conn->profile_size = size;
+    }
+  else
+    {
+      lua_pushboolean(L, 1);
+      return 1;
+    }
+  sqlite3_trace_v2(conn->sql_conn, SQLITE_TRACE_PROFILE, profile_callback, conn);
+  lua_pushboolean(L, 1);
   return 1;
 }
 
 
 /*
-** Connection object collector function
+** Return the statements of the profile ring buffer, oldest first.
 */
-static int conn_gc(lua_State *L)
+static int conn_getprofile(lua_State *L)
 {
-  conn_data *conn = (conn_data *)luaL_checkudata(L, 1, LUASQL_CONNECTION_SQLITE);
-  if (conn != NULL && !(conn->closed))
+  conn_data *conn = getconnection(L);
+  int i;
+
+  lua_newtable(L);
+  for (i = 0; i < conn->profile_count; i++)
     {
-      if (conn->cur_counter > 0)
-        return luaL_error (L, LUASQL_PREFIX"there are open cursors");
+      int pos = conn->profile_next - conn->profile_count + i;
+      profile_entry *entry = &conn->profile_ring[(pos + conn->profile_size) % conn->profile_size];
+      lua_newtable(L);
+      lua_pushstring(L, entry->sql);
+      lua_setfield(L, -2, "sql");
+      lua_pushnumber(L, (lua_Number)entry->ns);
+      lua_setfield(L, -2, "time");
+      lua_rawseti(L, -2, i + 1);
+    }
+  return 1;
+}
+#endif
 
-      /* Nullify structure fields. */
-      conn->closed = 1;
-      luaL_unref(L, LUA_REGISTRYINDEX, conn->env);
-      sqlite3_close(conn->sql_conn);
+
+/*
+** Set the result of a SQL function to the value at index idx.
+*/
+static void result_value(lua_State *L, sqlite3_context *ctx, int idx)
+{
+  switch (lua_type(L, idx)) {
+  case LUA_TNONE:
+  case LUA_TNIL:
+    sqlite3_result_null(ctx);
+    break;
+  case LUA_TBOOLEAN:
+    sqlite3_result_int(ctx, lua_toboolean(L, idx));
+    break;
+  case LUA_TNUMBER:
+    {
+      sqlite3_int64 n;
+      if (tointeger(L, idx, &n))
+        sqlite3_result_int64(ctx, n);
+      else
+        sqlite3_result_double(ctx, lua_tonumber(L, idx));
+      break;
     }
-  return 0;
+  case LUA_TSTRING:
+    {
+      size_t len;
+      const char *s = lua_tolstring(L, idx, &len);
+      sqlite3_result_text(ctx, s, (int)len, SQLITE_TRANSIENT);
+      break;
+    }
+  default:
+    sqlite3_result_error(ctx, LUASQL_PREFIX"invalid function result", -1);
+    break;
+  }
 }
 
 
 /*
-** Close a Connection object.
+** Call the function on the stack of L, below its first argument and the
+** n arguments of the SQL function, and set the result of the SQL function
+** to its result (if result is not zero) or error.
+** Return 0 in case of error.
 */
-static int conn_close(lua_State *L)
+static int call_function(lua_State *L, sqlite3_context *ctx, int first,
+			 int argc, sqlite3_value **argv, int result)
 {
-  conn_data *conn = (conn_data *)luaL_checkudata(L, 1, LUASQL_CONNECTION_SQLITE);
-  luaL_argcheck (L, conn != NULL, 1, LUASQL_PREFIX"connection expected");
-  if (conn->closed)
+  int i;
+  if (!lua_checkstack(L, argc))
     {
-      lua_pushboolean(L, 0);
-      return 1;
+      lua_pop(L, 1 + first);
+      sqlite3_result_error(ctx, LUASQL_PREFIX"too many arguments", -1);
+      return 0;
     }
-  conn_gc(L);
-  lua_pushboolean(L, 1);
+  for (i = 0; i < argc; i++)
+    push_value(L, argv[i]);
+  if (lua_pcall(L, first + argc, 1, 0) != 0)
+    {
+      const char *msg = lua_tostring(L, -1);
+      sqlite3_result_error(ctx, msg != NULL ? msg : LUASQL_PREFIX"error in function", -1);
+      lua_pop(L, 1);
+      return 0;
+    }
+  if (result)
+    result_value(L, ctx, -1);
   return 1;
 }
 
-static int conn_escape(lua_State *L)
+
+/*
+** Scalar SQL function implemented by a Lua function.
+*/
+static void function_call(sqlite3_context *ctx, int argc, sqlite3_value **argv)
 {
-  const char *from = luaL_checklstring (L, 2, 0);
-  char *escaped = sqlite3_mprintf("%q", from);
-  if (escaped == NULL)
+  func_data *func = (func_data *)sqlite3_user_data(ctx);
+  lua_State *L = func->conn->L;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, func->func);
+  if (call_function(L, ctx, 0, argc, argv, 1))
+    lua_pop(L, 1);
+}
+
+
+/*
+** Step of an aggregate SQL function: the step function gets the current
+** state (nil at the first row) and the arguments and returns the new
+** state.
+*/
+static void aggregate_step(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  func_data *func = (func_data *)sqlite3_user_data(ctx);
+  lua_State *L = func->conn->L;
+  int *state = (int *)sqlite3_aggregate_context(ctx, sizeof(int));
+
+  if (state == NULL)
     {
-      lua_pushnil(L);
+      sqlite3_result_error_nomem(ctx);
+      return;
     }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, func->func);
+  /* the context is zeroed at the first row and 0 is not a valid reference */
+  if (*state == 0)
+    lua_pushnil(L);
   else
+    lua_rawgeti(L, LUA_REGISTRYINDEX, *state);
+  if (call_function(L, ctx, 1, argc, argv, 0))
     {
-      lua_pushstring(L, escaped);
-      sqlite3_free(escaped);
+      if (*state != 0)
+        luaL_unref(L, LUA_REGISTRYINDEX, *state);
+      *state = luaL_ref(L, LUA_REGISTRYINDEX);
     }
-  return 1;
 }
 
+
 /*
-** Execute an SQL statement.
-** Return a Cursor object if the statement is a query, otherwise
-** return the number of tuples affected by the statement.
+** End of an aggregate SQL function: the final function gets the state
+** and returns the result.
 */
-static int conn_execute(lua_State *L)
+static void aggregate_final(sqlite3_context *ctx)
+{
+  func_data *func = (func_data *)sqlite3_user_data(ctx);
+  lua_State *L = func->conn->L;
+  int *state = (int *)sqlite3_aggregate_context(ctx, 0);
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, func->final);
+  if (state == NULL || *state == 0)
+    lua_pushnil(L);
+  else
+    lua_rawgeti(L, LUA_REGISTRYINDEX, *state);
+  if (call_function(L, ctx, 1, 0, NULL, 1))
+    lua_pop(L, 1);
+  if (state != NULL && *state != 0)
+    luaL_unref(L, LUA_REGISTRYINDEX, *state);
+}
+
+
+/*
+** Release a function when it is replaced or the connection is closed.
+*/
+static void function_destroy(void *p)
+{
+  func_data *func = (func_data *)p;
+  lua_State *L = func->conn->L;
+  luaL_unref(L, LUA_REGISTRYINDEX, func->func);
+  luaL_unref(L, LUA_REGISTRYINDEX, func->final);
+  free(func);
+}
+
+
+/*
+** Register a SQL function implemented by the Lua function at index
+** func (and, for aggregates, final).
+*/
+static int create_function(lua_State *L, const char *name, int nargs,
+			   int func, int final, int opts)
 {
   conn_data *conn = getconnection(L);
-  const char *statement = luaL_checkstring(L, 2);
-  int res;
-  sqlite3_stmt *vm;
-  const char *errmsg;
-  int numcols;
-  const char *tail;
+  int flags = SQLITE_UTF8;
+  func_data *data;
 
-#if SQLITE_VERSION_NUMBER > 3006013
-  res = sqlite3_prepare_v2(conn->sql_conn, statement, -1, &vm, &tail);
-#else
-  res = sqlite3_prepare(conn->sql_conn, statement, -1, &vm, &tail);
+  luaL_argcheck(L, nargs >= -1 && nargs <= 127, final ? opts : 3,
+		LUASQL_PREFIX"invalid number of arguments");
+  luaL_checktype(L, func, LUA_TFUNCTION);
+  if (final)
+    luaL_checktype(L, final, LUA_TFUNCTION);
+#ifdef SQLITE_DETERMINISTIC
+  if (opts && opt_boolean(L, opts, "deterministic", 0))
+    flags |= SQLITE_DETERMINISTIC;
 #endif
-  if (res != SQLITE_OK)
+
+  data = (func_data *)malloc(sizeof(func_data));
+  if (data == NULL)
+    return luasql_faildirect(L, "out of memory");
+  data->conn = conn;
+  conn_thread(L, conn);
+  lua_pushvalue(L, func);
+  data->func = luaL_ref(L, LUA_REGISTRYINDEX);
+  data->final = LUA_NOREF;
+  if (final)
     {
-      errmsg = sqlite3_errmsg(conn->sql_conn);
-      return luasql_faildirect(L, errmsg);
+      lua_pushvalue(L, final);
+      data->final = luaL_ref(L, LUA_REGISTRYINDEX);
     }
 
-  /* process first result to retrive query information and type */
-  res = sqlite3_step(vm);
-  numcols = sqlite3_column_count(vm);
+  /* data is released by function_destroy, even in case of error */
+  if (sqlite3_create_function_v2(conn->sql_conn, name, nargs, flags, data,
+				 final ? NULL : function_call,
+				 final ? aggregate_step : NULL,
+				 final ? aggregate_final : NULL,
+				 function_destroy) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  lua_pushboolean(L, 1);
+  return 1;
+}
 
-  /* real query? if empty, must have numcols!=0 */
-  if ((res == SQLITE_ROW) || ((res == SQLITE_DONE) && numcols))
+
+/*
+** Register a scalar SQL function implemented by a Lua function.
+*/
+static int conn_create_function(lua_State *L)
+{
+  const char *name = luaL_checkstring(L, 2);
+  int nargs = (int)luaL_checknumber(L, 3);
+  return create_function(L, name, nargs, 4, 0, lua_istable(L, 5) ? 5 : 0);
+}
+
+
+/*
+** Register an aggregate SQL function implemented by Lua step and final
+** functions.
+*/
+static int conn_create_aggregate(lua_State *L)
+{
+  const char *name = luaL_checkstring(L, 2);
+  int opts = lua_istable(L, 5) ? 5 : 0;
+  int nargs = opts ? (int)opt_number(L, opts, "nargs", -1) : -1;
+  return create_function(L, name, nargs, 3, 4, opts);
+}
+
+
+/*
+** Set the maximum number of milliseconds a query may run, counted from
+** its execution to the fetch of its last row. Zero disables it.
+*/
+static int conn_setquerytimeout(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  int timeout = (int)luaL_checknumber(L, 2);
+  luaL_argcheck(L, timeout >= 0, 2, LUASQL_PREFIX"invalid timeout");
+  conn->query_timeout = timeout;
+  if (timeout > 0)
+    sqlite3_progress_handler(conn->sql_conn, LUASQL_SQLITE_PROGRESS_OPS,
+			     progress_handler, conn);
+  else
+    sqlite3_progress_handler(conn->sql_conn, 0, NULL, NULL);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Set the function called for each row changed by the connection, or,
+** with the option buffered, with the list of changes of each committed
+** transaction. False removes it.
+*/
+static int conn_on_update(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+
+  changes_clear(L, conn);
+  if (lua_toboolean(L, 2))
     {
-      sqlite3_reset(vm);
-      return create_cursor(L, 1, conn, vm, numcols);
+      luaL_checktype(L, 2, LUA_TFUNCTION);
+      if (lua_istable(L, 3))
+        {
+          conn->changes_buffered = opt_boolean(L, 3, "buffered", 0);
+          conn->changes_limit = (int)opt_number(L, 3, "limit", 0);
+        }
+      conn_thread(L, conn);
+      lua_pushvalue(L, 2);
+      conn->update_func = luaL_ref(L, LUA_REGISTRYINDEX);
     }
+  hooks_install(conn);
+  lua_pushboolean(L, 1);
+  return 1;
+}
 
-  if (res == SQLITE_DONE) /* and numcols==0, INSERT,UPDATE,DELETE statement */
+
+/*
+** Set a function called with no arguments when a transaction commits or
+** rolls back. False removes it.
+*/
+static int set_hook(lua_State *L, int *ref)
+{
+  conn_data *conn = getconnection(L);
+
+  luaL_unref(L, LUA_REGISTRYINDEX, *ref);
+  *ref = LUA_NOREF;
+  if (lua_toboolean(L, 2))
     {
-      sqlite3_finalize(vm);
-      /* return number of columns changed */
-      lua_pushnumber(L, sqlite3_changes(conn->sql_conn));
-      return 1;
+      luaL_checktype(L, 2, LUA_TFUNCTION);
+      conn_thread(L, conn);
+      lua_pushvalue(L, 2);
+      *ref = luaL_ref(L, LUA_REGISTRYINDEX);
     }
+  hooks_install(conn);
+  lua_pushboolean(L, 1);
+  return 1;
+}
 
-  /* error */
-  errmsg = sqlite3_errmsg(conn->sql_conn);
-  sqlite3_finalize(vm);
-  return luasql_faildirect(L, errmsg);
+
+/*
+** Set the function called before a transaction commits, which may turn
+** the commit into a rollback by returning true.
+*/
+static int conn_on_commit(lua_State *L)
+{
+  return set_hook(L, &getconnection(L)->commit_func);
+}
+
+
+/*
+** Set the function called when a transaction rolls back.
+*/
+static int conn_on_rollback(lua_State *L)
+{
+  return set_hook(L, &getconnection(L)->rollback_func);
 }
 
 
 /*
-** Commit the current transaction.
+** Interrupt the running query of the connection, which fails with an
+** "interrupted" error.
 */
-static int conn_commit(lua_State *L)
+static int conn_interrupt(lua_State *L)
 {
-  char *errmsg;
-  conn_data *conn = getconnection(L);
-  int res;
-  const char *sql = "COMMIT";
-
-  if (conn->auto_commit == 0) sql = "COMMIT;BEGIN";
-
-  res = sqlite3_exec(conn->sql_conn, sql, NULL, NULL, &errmsg);
-
-  if (res != SQLITE_OK)
-    {
-      lua_pushnil(L);
-      lua_pushliteral(L, LUASQL_PREFIX);
-      lua_pushstring(L, errmsg);
-      sqlite3_free(errmsg);
-      lua_concat(L, 2);
-      return 2;
-    }
+  sqlite3_interrupt(getconnection(L)->sql_conn);
   lua_pushboolean(L, 1);
   return 1;
 }
 
 
 /*
-** Rollback the current transaction.
+** Set the mode of the transactions begun by the connection:
+** "deferred", "immediate" or "exclusive".
 */
-static int conn_rollback(lua_State *L)
+static int conn_settransactionmode(lua_State *L)
 {
-  char *errmsg;
   conn_data *conn = getconnection(L);
-  int res;
-  const char *sql = "ROLLBACK";
-
-  if (conn->auto_commit == 0) sql = "ROLLBACK;BEGIN";
-
-  res = sqlite3_exec(conn->sql_conn, sql, NULL, NULL, &errmsg);
-  if (res != SQLITE_OK)
+  int mode = luaL_checkoption(L, 2, NULL, tx_modes);
+  if (mode != conn->tx_mode)
     {
-      lua_pushnil(L);
-      lua_pushliteral(L, LUASQL_PREFIX);
-      lua_pushstring(L, errmsg);
-      sqlite3_free(errmsg);
-      lua_concat(L, 2);
-      return 2;
+      conn->tx_mode = (short)mode;
+      sqlite3_finalize(conn->tx_vm[TX_BEGIN]);
+      conn->tx_vm[TX_BEGIN] = NULL;
     }
   lua_pushboolean(L, 1);
   return 1;
 }
 
-static int conn_getlastautoid(lua_State *L)
-{
-  conn_data *conn = getconnection(L);
-  lua_pushnumber(L, sqlite3_last_insert_rowid(conn->sql_conn));
-  return 1;
-}
-
 
 /*
 ** Set "auto commit" property of the connection.
@@ -491,26 +3338,18 @@ static int conn_getlastautoid(lua_State *L)
 static int conn_setautocommit(lua_State *L)
 {
   conn_data *conn = getconnection(L);
+  group_flush(conn);
   if (lua_toboolean(L, 2))
     {
       conn->auto_commit = 1;
       /* undo active transaction - ignore errors */
-      (void) sqlite3_exec(conn->sql_conn, "ROLLBACK", NULL, NULL, NULL);
+      (void) tx_exec(conn, TX_ROLLBACK);
     }
   else
     {
-      char *errmsg;
-      int res;
       conn->auto_commit = 0;
-      res = sqlite3_exec(conn->sql_conn, "BEGIN", NULL, NULL, &errmsg);
-      if (res != SQLITE_OK)
-        {
-	  lua_pushliteral(L, LUASQL_PREFIX);
-	  lua_pushstring(L, errmsg);
-	  sqlite3_free(errmsg);
-	  lua_concat(L, 2);
-	  lua_error(L);
-        }
+      if (tx_exec(conn, TX_BEGIN) != SQLITE_OK)
+        return luaL_error(L, LUASQL_PREFIX"%s", sqlite3_errmsg(conn->sql_conn));
     }
   lua_pushboolean(L, 1);
   return 1;
@@ -529,16 +3368,106 @@ static int create_connection(lua_State *L, int env, sqlite3 *sql_conn)
   conn->closed = 0;
   conn->env = LUA_NOREF;
   conn->auto_commit = 1;
+  conn->tx_mode = 0;
+  memset(conn->tx_vm, 0, sizeof(conn->tx_vm));
   conn->sql_conn = sql_conn;
   conn->cur_counter = 0;
+  conn->stmt_counter = 0;
+  conn->blob_counter = 0;
+  conn->cache_buckets = NULL;
+  conn->cache_head = conn->cache_tail = NULL;
+  conn->cache_nbuckets = 0;
+  conn->cache_size = conn->cache_capacity = 0;
+  conn->cache_hits = conn->cache_misses = conn->cache_evictions = 0;
+  conn->group_limit = conn->group_interval = 0;
+  conn->group_flushread = conn->group_open = 0;
+  conn->group_count = conn->group_largest = 0;
+  conn->group_start = 0;
+  conn->group_flushes = conn->group_writes = 0;
+  conn->busy_timeout = conn->busy_min = conn->busy_max = 0;
+  conn->busy_start = 0;
+  conn->busy_events = conn->busy_retries = conn->busy_failures = 0;
+  conn->busy_waited = 0;
+  conn->query_timeout = 0;
+  conn->query_deadline = 0;
+  conn->timed_out = 0;
+  conn->profile_func = LUA_NOREF;
+  conn->profile_ring = NULL;
+  conn->profile_size = conn->profile_next = conn->profile_count = 0;
+  conn->L = NULL;
+  conn->thread = LUA_NOREF;
+  conn->update_func = conn->commit_func = conn->rollback_func = LUA_NOREF;
+  conn->changes_buffered = conn->changes_ready = conn->changes_overflow = 0;
+  conn->changes_limit = 0;
+  conn->changes = NULL;
+  conn->changes_size = conn->changes_count = 0;
+  conn->changes_tables = NULL;
+  conn->changes_ntables = 0;
+  cache_resize(L, conn, LUASQL_SQLITE_CACHE_SIZE);
   lua_pushvalue (L, env);
   conn->env = luaL_ref (L, LUA_REGISTRYINDEX);
   return 1;
 }
 
 
+/*
+** Options of env:connect applied as PRAGMA statements, in this order.
+*/
+static const char *const connect_pragmas[] = {
+  "journal_mode", "synchronous", "cache_size", "mmap_size", "temp_store",
+  "foreign_keys", "wal_autocheckpoint", NULL
+};
+
+
+/*
+** Apply the pragmas of the options table to a new connection.
+** Return SQLITE_OK or an error code with the error message in errmsg,
+** which must be freed with sqlite3_free.
+*/
+static int apply_pragmas(lua_State *L, sqlite3 *conn, int opts, char **errmsg)
+{
+  int i, res = SQLITE_OK;
+
+  for (i = 0; connect_pragmas[i] != NULL && res == SQLITE_OK; i++)
+    {
+      const char *name = connect_pragmas[i];
+      char *sql = NULL;
+
+      lua_getfield(L, opts, name);
+      switch (lua_type(L, -1)) {
+      case LUA_TNIL:
+        break;
+      case LUA_TBOOLEAN:
+        sql = sqlite3_mprintf("PRAGMA %s=%s", name,
+			      lua_toboolean(L, -1) ? "ON" : "OFF");
+        break;
+      case LUA_TNUMBER:
+        sql = sqlite3_mprintf("PRAGMA %s=%lld", name,
+			      (sqlite3_int64)lua_tonumber(L, -1));
+        break;
+      case LUA_TSTRING:
+        sql = sqlite3_mprintf("PRAGMA %s=%Q", name, lua_tostring(L, -1));
+        break;
+      default:
+        *errmsg = sqlite3_mprintf("invalid value for option '%s'", name);
+        res = SQLITE_MISUSE;
+        break;
+      }
+      lua_pop(L, 1);
+      if (sql != NULL)
+        {
+          res = sqlite3_exec(conn, sql, NULL, NULL, errmsg);
+          sqlite3_free(sql);
+        }
+    }
+  return res;
+}
+
+
 /*
 ** Connects to a data source.
+** The optional third argument is either the lock timeout (followed by
+** the read only flag) or a table of options.
 */
 static int env_connect(lua_State *L)
 {
@@ -548,18 +3477,46 @@ static int env_connect(lua_State *L)
   int res;
   bool readOnlyMode = false;
   int mode;
+  int opts = 0;                   /* index of the options table */
+  lua_Number timeout = -1;
+  lua_Number cache_size = LUASQL_SQLITE_CACHE_SIZE;
+  int tx_mode = 0;
 
   getenvironment(L);  /* validate environment */
 
-  if (lua_isboolean(L, 4)) {
-    if (lua_toboolean(L, 4)) {
-      readOnlyMode = true;
+  if (lua_istable(L, 3))
+    {
+      opts = 3;
+      readOnlyMode = opt_boolean(L, opts, "readonly", false);
+      timeout = opt_number(L, opts, "timeout", timeout);
+      cache_size = opt_number(L, opts, "statement_cache", cache_size);
+      lua_getfield(L, opts, "transaction_mode");
+      if (!lua_isnil(L, -1))
+        {
+          const char *name = lua_tostring(L, -1);
+          for (tx_mode = 0; tx_modes[tx_mode] != NULL; tx_mode++)
+            if (name != NULL && strcmp(name, tx_modes[tx_mode]) == 0)
+              break;
+          if (tx_modes[tx_mode] == NULL)
+            return luaL_error(L, LUASQL_PREFIX"invalid transaction mode");
+        }
+      lua_pop(L, 1);
+    }
+  else
+    {
+      if (lua_isboolean(L, 4)) {
+        if (lua_toboolean(L, 4)) {
+          readOnlyMode = true;
+        }
+      }
+      if (lua_isnumber(L, 3)) {
+        timeout = lua_tonumber(L, 3); /* TODO: remove this */
+      }
     }
-  }
 
   sourcename = luaL_checkstring(L, 2);
 #if SQLITE_VERSION_NUMBER > 3006013
-  if (strstr(sourcename, ":memory:")) /* TODO: rework this and get/add param 'flag' for sqlite3_open_v2 - see TODO below */
+  if (strstr(sourcename, ":memory:"))
   {
     if (readOnlyMode) {
       mode = SQLITE_OPEN_READONLY | SQLITE_OPEN_MEMORY;
@@ -575,8 +3532,21 @@ static int env_connect(lua_State *L)
       mode = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
     }
   }
+  if (opts)
+    {
+      mode = (int)opt_number(L, opts, "flags", mode);
+      if (opt_boolean(L, opts, "uri", 0))
+        mode |= SQLITE_OPEN_URI;
+      if (opt_boolean(L, opts, "nomutex", 0))
+        mode |= SQLITE_OPEN_NOMUTEX;
+      /* the flags can not make a read only connection writable */
+      if (readOnlyMode)
+        mode = (mode & ~(SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE)) |
+               SQLITE_OPEN_READONLY;
+    }
   res = sqlite3_open_v2(sourcename, &conn, mode, NULL);
 #else
+  (void)mode;
   res = sqlite3_open(sourcename, &conn);
 #endif
   if (res != SQLITE_OK)
@@ -587,11 +3557,406 @@ static int env_connect(lua_State *L)
       return 2;
     }
 
-  if (lua_isnumber(L, 3)) {
-  	sqlite3_busy_timeout(conn, lua_tonumber(L,3)); /* TODO: remove this */
+  if (timeout >= 0) {
+  	sqlite3_busy_timeout(conn, (int)timeout);
   }
 
-  return create_connection(L, 1, conn);
+  if (opts)
+    {
+      char *err = NULL;
+      if (apply_pragmas(L, conn, opts, &err) != SQLITE_OK)
+        {
+          luasql_faildirect(L, err != NULL ? err : sqlite3_errmsg(conn));
+          sqlite3_free(err);
+          sqlite3_close(conn);
+          return 2;
+        }
+    }
+
+  create_connection(L, 1, conn);
+  ((conn_data *)lua_touserdata(L, -1))->tx_mode = (short)tx_mode;
+  if (cache_size != LUASQL_SQLITE_CACHE_SIZE)
+    cache_resize(L, (conn_data *)lua_touserdata(L, -1), (int)cache_size);
+  if (opts)
+    {
+      lua_getfield(L, opts, "group_commit");
+      group_configure(L, (conn_data *)lua_touserdata(L, -2), lua_gettop(L));
+      lua_pop(L, 1);
+      lua_getfield(L, opts, "busy_handler");
+      if (lua_istable(L, -1))
+        busy_configure(L, (conn_data *)lua_touserdata(L, -2), lua_gettop(L));
+      lua_pop(L, 1);
+      lua_getfield(L, opts, "query_timeout");
+      if (!lua_isnil(L, -1))
+        {
+          lua_pushcfunction(L, conn_setquerytimeout);
+          lua_pushvalue(L, -3);
+          lua_pushvalue(L, -3);
+          lua_call(L, 2, 0);
+        }
+      lua_pop(L, 1);
+    }
+  return 1;
+}
+
+
+/*
+** Push a copy of the options table at index opts, or a new table if
+** opts is 0.
+*/
+static void copy_options(lua_State *L, int opts)
+{
+  lua_newtable(L);
+  if (opts)
+    {
+      lua_pushnil(L);
+      while (lua_next(L, opts) != 0)
+        {
+          lua_pushvalue(L, -2);
+          lua_insert(L, -2);
+          lua_rawset(L, -4);
+        }
+    }
+}
+
+
+/*
+** Open a connection of a pool with the options at index opts.
+** Leave the connection on top of the stack and return 1, or leave
+** nil and the error message and return 0.
+*/
+static int pool_connect(lua_State *L, int opts)
+{
+  lua_pushcfunction(L, env_connect);
+  lua_pushvalue(L, 1);
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, opts);
+  lua_call(L, 3, 2);
+  if (lua_isnil(L, -2))
+    return 0;
+  lua_pop(L, 1);
+  return 1;
+}
+
+
+/*
+** Close all connections of the pool.
+** A connection which could not be closed is kept by the pool, which
+** stays open.
+** Return 0 and leave the first error message on the stack if some of
+** them could not be closed or reported an error.
+*/
+static int pool_release(lua_State *L, pool_data *pool)
+{
+  int i, err = 0, left = 0;
+  for (i = -1; i < pool->nreaders; i++)
+    {
+      int *ref = (i < 0) ? &pool->writer : &pool->readers[i];
+      conn_data *conn;
+      if (*ref == LUA_NOREF)
+        continue;
+      lua_pushcfunction(L, conn_close);
+      lua_rawgeti(L, LUA_REGISTRYINDEX, *ref);
+      conn = (conn_data *)lua_touserdata(L, -1);
+      if (lua_pcall(L, 1, 2, 0) == 0)
+        lua_remove(L, -2);  /* keep the error message or nil */
+      if (err == 0 && lua_isstring(L, -1))
+        err = lua_gettop(L);
+      else
+        lua_pop(L, 1);
+      if (conn->closed)
+        {
+          luaL_unref(L, LUA_REGISTRYINDEX, *ref);
+          *ref = LUA_NOREF;
+        }
+      else
+        left++;
+    }
+  if (left == 0)
+    {
+      pool->closed = 1;
+      luaL_unref(L, LUA_REGISTRYINDEX, pool->kinds);
+    }
+  return err == 0;
+}
+
+
+/*
+** Connects to a WAL database with a pool of read only connections and
+** a single writer connection.
+** Return a Pool object.
+*/
+static int env_connectpool(lua_State *L)
+{
+  int opts = lua_istable(L, 3) ? 3 : 0;
+  int nreaders = 4;
+  int i;
+  pool_data *pool;
+
+  getenvironment(L);  /* validate environment */
+  luaL_checkstring(L, 2);
+  if (opts)
+    nreaders = (int)opt_number(L, opts, "readers", nreaders);
+  luaL_argcheck(L, nreaders > 0, 3, LUASQL_PREFIX"invalid number of readers");
+
+  pool = (pool_data *)lua_newuserdata(L, sizeof(pool_data) + (nreaders-1)*sizeof(int));
+  luasql_setmeta(L, LUASQL_POOL_SQLITE);
+
+  /* fill in structure */
+  pool->closed = 0;
+  pool->next = 0;
+  pool->nreaders = nreaders;
+  pool->reads = pool->writes = 0;
+  lua_newtable(L);
+  pool->kinds = luaL_ref(L, LUA_REGISTRYINDEX);
+  pool->nkinds = 0;
+  pool->writer = LUA_NOREF;
+  for (i = 0; i < nreaders; i++)
+    pool->readers[i] = LUA_NOREF;
+
+  /* the writer creates the database and turns WAL mode on */
+  copy_options(L, opts);
+  lua_getfield(L, -1, "journal_mode");
+  if (lua_isnil(L, -1))
+    {
+      lua_pushliteral(L, "wal");
+      lua_setfield(L, -3, "journal_mode");
+    }
+  lua_pop(L, 1);
+  if (!pool_connect(L, lua_gettop(L)))
+    {
+      if (!pool_release(L, pool))
+        lua_pop(L, 1);
+      return 2;
+    }
+  pool->writer = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_pop(L, 1);
+
+  copy_options(L, opts);
+  lua_pushboolean(L, 1);
+  lua_setfield(L, -2, "readonly");
+  lua_pushnil(L);
+  lua_setfield(L, -2, "journal_mode");
+  lua_pushnil(L);
+  lua_setfield(L, -2, "group_commit");
+  for (i = 0; i < nreaders; i++)
+    {
+      if (!pool_connect(L, lua_gettop(L)))
+        {
+          if (!pool_release(L, pool))
+            lua_pop(L, 1);
+          return 2;
+        }
+      pool->readers[i] = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+  lua_pop(L, 1);
+  return 1;
+}
+
+
+/*
+** Return 1 if the SQL text is known to be a query, 0 if it is known
+** to be another statement and -1 if it was not seen yet.
+*/
+static int pool_getkind(lua_State *L, pool_data *pool, const char *sql, size_t len)
+{
+  int kind;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, pool->kinds);
+  lua_pushlstring(L, sql, len);
+  lua_rawget(L, -2);
+  kind = lua_isnil(L, -1) ? -1 : lua_toboolean(L, -1);
+  lua_pop(L, 2);
+  return kind;
+}
+
+
+/*
+** Remember whether the SQL text is a query, starting again once
+** LUASQL_SQLITE_POOL_KINDS texts are known.
+*/
+static void pool_setkind(lua_State *L, pool_data *pool, const char *sql, size_t len,
+			 int kind)
+{
+  if (pool->nkinds >= LUASQL_SQLITE_POOL_KINDS)
+    {
+      luaL_unref(L, LUA_REGISTRYINDEX, pool->kinds);
+      lua_newtable(L);
+      pool->kinds = luaL_ref(L, LUA_REGISTRYINDEX);
+      pool->nkinds = 0;
+    }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, pool->kinds);
+  lua_pushlstring(L, sql, len);
+  lua_pushboolean(L, kind);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+  pool->nkinds++;
+}
+
+
+/*
+** Execute an SQL statement on a connection of the pool.
+** Queries go to the readers in turn, other statements to the writer.
+** While the writer is in a transaction, every statement goes to it.
+** The first time an SQL text is seen, it is compiled by a reader to
+** find out whether it is a query; other statements are not kept by
+** the reader.
+*/
+static int pool_execute(lua_State *L)
+{
+  pool_data *pool = getpool(L);
+  size_t len;
+  const char *statement = luaL_checklstring(L, 2, &len);
+  conn_data *writer;
+  cache_entry *entry;
+  sqlite3_stmt *vm;
+  int kind;
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, pool->writer);
+  writer = (conn_data *)lua_touserdata(L, -1);
+  if (writer == NULL || writer->closed)
+    return luaL_error(L, LUASQL_PREFIX"connection is closed");
+
+  /* the readers do not see the writes of an open group commit batch */
+  if (writer->group_open && writer->group_flushread &&
+      group_flush(writer) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(writer->sql_conn));
+  if (sqlite3_get_autocommit(writer->sql_conn) && !writer->group_open &&
+      (kind = pool_getkind(L, pool, statement, len)) != 0)
+    {
+      conn_data *reader;
+      lua_rawgeti(L, LUA_REGISTRYINDEX, pool->readers[pool->next]);
+      reader = (conn_data *)lua_touserdata(L, -1);
+      pool->next = (pool->next + 1) % pool->nreaders;
+      if (reader != NULL && !reader->closed && kind > 0 &&
+          get_vm(reader, statement, len, &vm, &entry) == SQLITE_OK)
+        {
+          pool->reads++;
+          return execute_vm(L, lua_gettop(L), reader, entry, vm);
+        }
+      if (reader != NULL && !reader->closed && kind < 0 &&
+          sql_prepare(reader, statement, reader->cache_capacity > 0, &vm, NULL) == SQLITE_OK &&
+          vm != NULL)
+        {
+          kind = sqlite3_stmt_readonly(vm) && sqlite3_column_count(vm) > 0;
+          pool_setkind(L, pool, statement, len, kind);
+          if (kind)
+            {
+              reader->cache_misses++;
+              pool->reads++;
+              entry = cache_newentry(reader, statement, len, vm);
+              return execute_vm(L, lua_gettop(L), reader, entry, vm);
+            }
+          sqlite3_finalize(vm);
+        }
+      lua_pop(L, 1);
+    }
+
+  pool->writes++;
+  if (get_vm(writer, statement, len, &vm, &entry) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(writer->sql_conn));
+  return execute_vm(L, lua_gettop(L), writer, entry, vm);
+}
+
+
+/*
+** Return the writer connection of the pool.
+*/
+static int pool_writer(lua_State *L)
+{
+  lua_rawgeti(L, LUA_REGISTRYINDEX, getpool(L)->writer);
+  return 1;
+}
+
+
+/*
+** Return the next reader connection of the pool.
+*/
+static int pool_reader(lua_State *L)
+{
+  pool_data *pool = getpool(L);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, pool->readers[pool->next]);
+  pool->next = (pool->next + 1) % pool->nreaders;
+  return 1;
+}
+
+
+/*
+** Return a table with the counters of the pool.
+*/
+static int pool_stats(lua_State *L)
+{
+  pool_data *pool = getpool(L);
+  lua_newtable(L);
+  lua_pushnumber(L, pool->reads);
+  lua_setfield(L, -2, "reads");
+  lua_pushnumber(L, pool->writes);
+  lua_setfield(L, -2, "writes");
+  lua_pushinteger(L, pool->nreaders);
+  lua_setfield(L, -2, "readers");
+  return 1;
+}
+
+
+/*
+** Pool object collector function.
+** Its connections are collected on their own.
+*/
+static int pool_gc(lua_State *L)
+{
+  pool_data *pool = (pool_data *)luaL_checkudata(L, 1, LUASQL_POOL_SQLITE);
+  if (pool != NULL && !(pool->closed))
+    {
+      int i;
+      pool->closed = 1;
+      luaL_unref(L, LUA_REGISTRYINDEX, pool->kinds);
+      luaL_unref(L, LUA_REGISTRYINDEX, pool->writer);
+      for (i = 0; i < pool->nreaders; i++)
+        luaL_unref(L, LUA_REGISTRYINDEX, pool->readers[i]);
+    }
+  return 0;
+}
+
+
+/*
+** Close the pool and all its connections.
+** Return true in case of success, false in case the pool was already
+** closed, or false and an error message if a connection could not be
+** closed.
+*/
+static int pool_close(lua_State *L)
+{
+  pool_data *pool = (pool_data *)luaL_checkudata(L, 1, LUASQL_POOL_SQLITE);
+  int i;
+  luaL_argcheck(L, pool != NULL, 1, LUASQL_PREFIX"pool expected");
+  if (pool->closed)
+    {
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+  for (i = -1; i < pool->nreaders; i++)
+    {
+      conn_data *conn;
+      lua_rawgeti(L, LUA_REGISTRYINDEX, (i < 0) ? pool->writer : pool->readers[i]);
+      conn = (conn_data *)lua_touserdata(L, -1);
+      if (conn != NULL && !conn->closed)
+        {
+          if (conn->cur_counter > 0)
+            return luaL_error(L, LUASQL_PREFIX"there are open cursors");
+          if (conn->stmt_counter > 0)
+            return luaL_error(L, LUASQL_PREFIX"there are open statements");
+          if (conn->blob_counter > 0)
+            return luaL_error(L, LUASQL_PREFIX"there are open blobs");
+        }
+      lua_pop(L, 1);
+    }
+  if (!pool_release(L, pool))
+    {
+      lua_pushboolean(L, 0);
+      lua_insert(L, -2);
+      return 2;
+    }
+  lua_pushboolean(L, 1);
+  return 1;
 }
 
 
@@ -607,6 +3972,70 @@ static int env_gc (lua_State *L)
 }
 
 
+/*
+** Return a table with the memory counters of SQLite, shared by all
+** connections of the process: the current value of each one and its
+** highest value, in the field with the suffix "_highwater".
+** If the argument is true, the highest values are reset.
+*/
+static int env_memstats(lua_State *L)
+{
+  int reset = lua_toboolean(L, 2);
+  int i;
+
+  getenvironment(L);
+  lua_newtable(L);
+  for (i = 0; mem_counters[i].name != NULL; i++)
+    {
+#if SQLITE_VERSION_NUMBER >= 3010000
+      sqlite3_int64 current = 0, highwater = 0;
+      sqlite3_status64(mem_counters[i].op, &current, &highwater, reset);
+#else
+      int current = 0, highwater = 0;
+      sqlite3_status(mem_counters[i].op, &current, &highwater, reset);
+#endif
+      lua_pushnumber(L, (lua_Number)current);
+      lua_setfield(L, -2, mem_counters[i].name);
+      lua_pushfstring(L, "%s_highwater", mem_counters[i].name);
+      lua_pushnumber(L, (lua_Number)highwater);
+      lua_rawset(L, -3);
+    }
+  return 1;
+}
+
+
+/*
+** Set the soft limit of the memory allocated by SQLite, which it tries
+** to keep by releasing cache pages. Zero removes it and a negative
+** value (or none) keeps it.
+** Return the previous limit.
+*/
+static int env_softheaplimit(lua_State *L)
+{
+  getenvironment(L);
+  lua_pushnumber(L, (lua_Number)sqlite3_soft_heap_limit64(
+    (sqlite3_int64)luaL_optnumber(L, 2, -1)));
+  return 1;
+}
+
+
+#if SQLITE_VERSION_NUMBER >= 3031000
+/*
+** Set the hard limit of the memory allocated by SQLite, beyond which
+** its allocations fail. Zero removes it and a negative value (or none)
+** keeps it.
+** Return the previous limit.
+*/
+static int env_hardheaplimit(lua_State *L)
+{
+  getenvironment(L);
+  lua_pushnumber(L, (lua_Number)sqlite3_hard_heap_limit64(
+    (sqlite3_int64)luaL_optnumber(L, 2, -1)));
+  return 1;
+}
+#endif
+
+
 /*
 ** Close environment object.
 */
@@ -624,17 +4053,6 @@ static int env_close (lua_State *L)
 }
 
 
-/*
-** Sets the timeout for a lock in the connection.
-static int opts_settimeout  (lua_State *L)
-{
-	conn_data *conn = getconnection(L);
-	int milisseconds = luaL_checknumber(L, 2);
-	lua_pushnumber(L, sqlite3_busy_timeout(conn->sql_conn, milisseconds));
-	return 1;
-}
-*/
-
 /*
 ** Create metatables for each class of object.
 */
@@ -644,6 +4062,12 @@ static void create_metatables (lua_State *L)
     {"__gc", env_gc},
     {"close", env_close},
     {"connect", env_connect},
+    {"connectpool", env_connectpool},
+    {"memstats", env_memstats},
+    {"softheaplimit", env_softheaplimit},
+#if SQLITE_VERSION_NUMBER >= 3031000
+    {"hardheaplimit", env_hardheaplimit},
+#endif
     {NULL, NULL},
   };
   struct luaL_Reg connection_methods[] = {
@@ -651,10 +4075,69 @@ static void create_metatables (lua_State *L)
     {"close", conn_close},
     {"escape", conn_escape},
     {"execute", conn_execute},
+    {"execscript", conn_execscript},
+    {"executemany", conn_executemany},
     {"commit", conn_commit},
     {"rollback", conn_rollback},
     {"setautocommit", conn_setautocommit},
+    {"settransactionmode", conn_settransactionmode},
+    {"setquerytimeout", conn_setquerytimeout},
+    {"interrupt", conn_interrupt},
+    {"on_update", conn_on_update},
+    {"on_commit", conn_on_commit},
+    {"on_rollback", conn_on_rollback},
+    {"create_function", conn_create_function},
+    {"create_aggregate", conn_create_aggregate},
     {"getlastautoid", conn_getlastautoid},
+    {"prepare", conn_prepare},
+    {"setcachesize", conn_setcachesize},
+    {"cachestats", conn_cachestats},
+    {"openblob", conn_openblob},
+    {"setgroupcommit", conn_setgroupcommit},
+    {"flush", conn_flush},
+    {"groupstats", conn_groupstats},
+    {"setbusyhandler", conn_setbusyhandler},
+    {"busystats", conn_busystats},
+    {"dbstatus", conn_dbstatus},
+    {"checkpoint", conn_checkpoint},
+    {"setautocheckpoint", conn_setautocheckpoint},
+    {"optimize", conn_optimize},
+    {"backup_to", conn_backup_to},
+#if SQLITE_VERSION_NUMBER >= 3014000
+    {"setprofile", conn_setprofile},
+    {"getprofile", conn_getprofile},
+#endif
+#if SQLITE_VERSION_NUMBER >= 3036000 || defined(SQLITE_ENABLE_DESERIALIZE)
+    {"serialize", conn_serialize},
+    {"deserialize", conn_deserialize},
+#endif
+    {NULL, NULL},
+  };
+  struct luaL_Reg statement_methods[] = {
+    {"__gc", stmt_gc},
+    {"close", stmt_close},
+    {"bind", stmt_bind},
+    {"execute", stmt_execute},
+    {NULL, NULL},
+  };
+  struct luaL_Reg blob_methods[] = {
+    {"__gc", blob_gc},
+    {"close", blob_close},
+    {"read", blob_read},
+    {"write", blob_write},
+    {"size", blob_size},
+#if SQLITE_VERSION_NUMBER >= 3007004
+    {"reopen", blob_reopen},
+#endif
+    {NULL, NULL},
+  };
+  struct luaL_Reg pool_methods[] = {
+    {"__gc", pool_gc},
+    {"close", pool_close},
+    {"execute", pool_execute},
+    {"writer", pool_writer},
+    {"reader", pool_reader},
+    {"stats", pool_stats},
     {NULL, NULL},
   };
   struct luaL_Reg cursor_methods[] = {
@@ -663,12 +4146,18 @@ static void create_metatables (lua_State *L)
     {"getcolnames", cur_getcolnames},
     {"getcoltypes", cur_getcoltypes},
     {"fetch", cur_fetch},
+    {"fetchmany", cur_fetchmany},
+    {"fetchall", cur_fetchall},
+    {"stats", cur_stats},
     {NULL, NULL},
   };
   luasql_createmeta(L, LUASQL_ENVIRONMENT_SQLITE, environment_methods);
   luasql_createmeta(L, LUASQL_CONNECTION_SQLITE, connection_methods);
   luasql_createmeta(L, LUASQL_CURSOR_SQLITE, cursor_methods);
-  lua_pop (L, 3);
+  luasql_createmeta(L, LUASQL_STATEMENT_SQLITE, statement_methods);
+  luasql_createmeta(L, LUASQL_BLOB_SQLITE, blob_methods);
+  luasql_createmeta(L, LUASQL_POOL_SQLITE, pool_methods);
+  lua_pop (L, 6);
 }
 
 /*
@@ -9,3 +9,275 @@ table.insert (CUR_METHODS, "numrows")
 table.insert (EXTENSIONS, numrows)
 table.insert (CONN_METHODS, "escape")
 table.insert (EXTENSIONS, escape)
+
+---------------------------------------------------------------------
+-- Streaming cursors
+---------------------------------------------------------------------
+function stream ()
+	local cur = CUR_OK (CONN:stream ("select i, 'v'||i from generate_series (1, 1000) as i"))
+	assert2 (nil, cur:numrows (), "streaming cursor knows its size")
+	assert2 (false, pcall (CONN.execute, CONN, "select 1"))
+	local n = 0
+	local i, v = cur:fetch ()
+	while i do
+		n = n + 1
+		assert2 (tostring (n), i)
+		assert2 ("v"..n, v)
+		i, v = cur:fetch ()
+	end
+	assert2 (1000, n)
+	assert2 (false, cur:close ())
+
+	-- closing before the last row releases the connection
+	cur = CUR_OK (CONN:stream ("select i from generate_series (1, 100000) as i", 100))
+	assert2 ("1", cur:fetch ())
+	assert2 ("2", cur:fetch ())
+	assert2 (true, cur:close ())
+	cur = CUR_OK (CONN:execute ("select 1"))
+	cur:close ()
+
+	-- queries without rows and statements
+	cur = CUR_OK (CONN:stream ("select 1 where false"))
+	assert2 (nil, cur:fetch ())
+	assert2 (nil, CONN:stream ("select * from nothing"))
+	assert2 (0, CONN:stream ("set application_name = 'luasql'"))
+
+	-- an error after the first rows is returned by fetch
+	cur = CUR_OK (CONN:stream ("select 1/(i - 3) from generate_series (1, 5) as i"))
+	assert2 ("0", cur:fetch ())
+	assert2 ("-1", cur:fetch ())
+	assert2 (nil, cur:fetch (), "division by zero")
+	assert2 (false, cur:close ())
+	io.write (" stream")
+end
+
+table.insert (CONN_METHODS, "stream")
+table.insert (EXTENSIONS, stream)
+
+---------------------------------------------------------------------
+-- Prepared statements
+---------------------------------------------------------------------
+function prepare ()
+	local stmt = assert (CONN:prepare ("select $1::integer + $2, $3::text, $4::boolean"))
+	local cur = CUR_OK (stmt:execute (1, 2.5, "a'b", true))
+	local sum, text, bool = cur:fetch ()
+	assert2 (3.5, tonumber (sum))
+	assert2 ("a'b", text)
+	assert2 ("t", bool)
+	cur:close ()
+	cur = CUR_OK (stmt:execute ({ 10, 20, nil, false }))
+	sum, text, bool = cur:fetch ()
+	assert2 ("30", sum)
+	assert2 (nil, text)
+	assert2 ("f", bool)
+	cur:close ()
+	assert2 (true, stmt:bind (1, 1, "x", true))
+	cur = CUR_OK (stmt:execute ())
+	assert2 ("2", cur:fetch ())
+	cur:close ()
+	assert2 (false, pcall (stmt.execute, stmt, 1, 2, 3, 4, 5))
+	assert2 (nil, stmt:execute ("one", 2), "invalid integer accepted")
+	assert2 (true, stmt:close ())
+	assert2 (false, stmt:close ())
+
+	stmt = assert (CONN:prepare ("select $1::int8, $2::float8"))
+	cur = CUR_OK (stmt:execute (100000000000000000, 0.1))
+	sum, text = cur:fetch ()
+	assert2 ("100000000000000000", sum)
+	assert2 (0.1, tonumber (text))
+	cur:close ()
+	if math.type then
+		cur = CUR_OK (stmt:execute (9007199254740993, 1))
+		assert2 ("9007199254740993", cur:fetch ())
+		cur:close ()
+	end
+	assert2 (true, stmt:close ())
+
+	stmt = assert (CONN:prepare ("select $1::integer", "luasql_named"))
+	cur = CUR_OK (CONN:execute ("execute luasql_named (7)"))
+	assert2 ("7", cur:fetch ())
+	cur:close ()
+	assert2 (nil, CONN:prepare ("select 1", "luasql_named"), "duplicate name accepted")
+	assert2 (true, stmt:close ())
+	assert2 (nil, CONN:execute ("execute luasql_named (7)"), "statement not deallocated")
+	stmt = assert (CONN:prepare ("select 1", "luasql_collected"))
+	stmt = nil
+	collectgarbage ()
+	collectgarbage ()
+	assert2 (nil, CONN:execute ("execute luasql_collected"), "collected statement not deallocated")
+	assert2 (true, CONN:setautocommit (false))
+	stmt = assert (CONN:prepare ("select 1", "luasql_aborted"))
+	assert2 (nil, CONN:execute ("select * from nothing"))
+	assert2 (true, stmt:close ())
+	assert2 (true, CONN:rollback ())
+	assert2 (true, CONN:setautocommit (true))
+	assert2 (nil, CONN:execute ("execute luasql_aborted"), "statement closed in an aborted transaction not deallocated")
+	assert2 (nil, CONN:prepare ("select * from nothing"))
+	io.write (" prepare")
+end
+
+table.insert (CONN_METHODS, "prepare")
+table.insert (EXTENSIONS, prepare)
+
+---------------------------------------------------------------------
+-- Binary results
+---------------------------------------------------------------------
+function binary ()
+	assert2 (true, CONN:setbinary (true))
+	local cur = CUR_OK (CONN:execute ([[select 1::int2, -2::int4, 9007199254740993::int8,
+		true, 1.5::float4, -0.25::float8, 123.45::numeric, -0.001::numeric,
+		'text'::varchar, decode ('00ff', 'hex'),
+		'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11'::uuid,
+		'2000-01-01 00:00:01.5'::timestamp, '1970-01-02'::date, null::int4]]))
+	local row = cur:fetch ({})
+	cur:close ()
+	assert2 (1, row[1])
+	assert2 (-2, row[2])
+	if math.type then
+		assert2 ("integer", math.type (row[1]))
+		assert2 (9007199254740993, row[3])
+	end
+	assert2 (true, row[4])
+	assert2 (1.5, row[5])
+	assert2 (-0.25, row[6])
+	assert (math.abs (row[7] - 123.45) < 1e-9, "numeric not decoded")
+	assert (math.abs (row[8] + 0.001) < 1e-12, "numeric not decoded")
+	assert2 ("text", row[9])
+	assert2 ("\0\255", row[10])
+	assert2 ("a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11", row[11])
+	assert2 (946684801.5, row[12])
+	assert2 (86400, row[13])
+	assert2 (nil, row[14])
+
+	cur = CUR_OK (CONN:execute ("select 4294967295::oid, 'infinity'::date, '-infinity'::date, current_setting ('server_version_num')::int4"))
+	row = cur:fetch ({})
+	cur:close ()
+	assert2 (4294967295, row[1])
+	assert2 (math.huge, row[2])
+	assert2 (-math.huge, row[3])
+	if row[4] >= 140000 then
+		cur = CUR_OK (CONN:execute ("select 'infinity'::numeric, '-infinity'::numeric"))
+		row = cur:fetch ({})
+		cur:close ()
+		assert2 (math.huge, row[1])
+		assert2 (-math.huge, row[2])
+	end
+
+	local stmt = assert (CONN:prepare ("select $1::integer * 2"))
+	cur = CUR_OK (stmt:execute (21))
+	assert2 (42, cur:fetch ())
+	cur:close ()
+	stmt:close ()
+	cur = CUR_OK (CONN:stream ("select i from generate_series (1, 3) as i"))
+	assert2 (1, cur:fetch ())
+	cur:close ()
+
+	assert2 (true, CONN:setbinary (false))
+	cur = CUR_OK (CONN:execute ("select 1::int4"))
+	assert2 ("1", cur:fetch ())
+	cur:close ()
+	io.write (" binary")
+end
+
+table.insert (CONN_METHODS, "setbinary")
+table.insert (EXTENSIONS, binary)
+
+---------------------------------------------------------------------
+-- Type name cache
+---------------------------------------------------------------------
+function loadtypes ()
+	assert2 (true, CONN:loadtypes ())
+	local cur = CUR_OK (CONN:stream ("select 1::int4, 'a'::varchar(10), now ()"))
+	local types = cur:getcoltypes ()
+	assert2 ("int4", types[1])
+	assert2 ("varchar (10)", types[2])
+	assert2 ("timestamptz", types[3])
+	cur:close ()
+	assert (CONN:execute ("create type luasql_mood as enum ('ok', 'sad')"))
+	cur = CUR_OK (CONN:execute ("select 'ok'::luasql_mood"))
+	assert2 ("luasql_mood", cur:getcoltypes ()[1])
+	cur:close ()
+	assert (CONN:execute ("drop type luasql_mood"))
+	io.write (" loadtypes")
+end
+
+table.insert (CONN_METHODS, "loadtypes")
+table.insert (EXTENSIONS, loadtypes)
+
+---------------------------------------------------------------------
+-- COPY
+---------------------------------------------------------------------
+function copy ()
+	assert (CONN:execute ("create temporary table c (i integer, t text, b boolean)"))
+	assert2 (3, CONN:copy_in ("copy c from stdin", {
+		{ 1, "tab\there", true },
+		{ 2, "back\\slash\nnewline", false },
+		{ 3, nil, nil },
+	}))
+	assert (CONN:execute ("create temporary table c8 (v int8)"))
+	assert2 (1, CONN:copy_in ("copy c8 from stdin", { { 100000000000000000 } }))
+	local cur = CUR_OK (CONN:execute ("select v from c8"))
+	assert2 ("100000000000000000", cur:fetch ())
+	cur:close ()
+	assert (CONN:execute ("drop table c8"))
+	local i = 3
+	assert2 (2, CONN:copy_in ("copy c from stdin", function ()
+		i = i + 1
+		if i <= 5 then
+			return { i, "it"..i }
+		end
+	end))
+	assert2 (2, CONN:copy_in ("copy c (i, t) from stdin with (format csv)",
+		{ "6,six\n7,", "seven\n" }))
+	cur = CUR_OK (CONN:execute ("select t from c where i = 2"))
+	assert2 ("back\\slash\nnewline", cur:fetch ())
+	cur:close ()
+	cur = CUR_OK (CONN:execute ("select count(*) from c where b is null"))
+	assert2 ("5", cur:fetch ())
+	cur:close ()
+
+	assert2 (nil, CONN:copy_in ("copy c from stdin", { { 8, {} } }), "invalid value accepted")
+	assert2 (nil, CONN:copy_in ("copy c from stdin", { { 8, "x", true, 1 } }), "extra value accepted")
+	assert2 (nil, CONN:copy_in ("copy c from stdin", { { 8, nil, nil, 1 } }), "extra value accepted")
+	assert2 (false, pcall (CONN.copy_in, CONN, "copy c from stdin", function () error ("stop") end))
+	assert2 (false, pcall (CONN.copy_in, CONN, "copy c from stdin", function ()
+		assert (CONN:execute ("select 1"))
+	end), "connection used during COPY")
+	local first = true
+	assert2 (false, pcall (CONN.copy_in, CONN, "copy c from stdin", function ()
+		if first then
+			first = false
+			return { 9, "partial" }
+		end
+		error ({})
+	end), "non-string error ignored")
+	cur = CUR_OK (CONN:execute ("select count(*) from c where i >= 8"))
+	assert2 ("0", cur:fetch (), "aborted COPY loaded rows")
+	cur:close ()
+	assert2 (nil, CONN:copy_in ("copy c from stdin", { { "x" } }), "invalid integer accepted")
+	assert2 (nil, CONN:copy_in ("select 1", {}), "not a COPY")
+	assert2 (nil, CONN:copy_in ("copy c to stdout", {}), "wrong direction")
+
+	local chunks = {}
+	assert2 (7, CONN:copy_out ("copy c (i) to stdout", function (data)
+		chunks[#chunks+1] = data
+	end))
+	assert2 ("1\n2\n3\n4\n5\n6\n7\n", table.concat (chunks))
+	local f = io.tmpfile ()
+	assert2 (7, CONN:copy_out ("copy (select i, t from c order by i) to stdout with (format csv)", f))
+	f:seek ("set")
+	assert2 ("1,tab\there", f:read ("*l"))
+	f:close ()
+	assert2 (false, pcall (CONN.copy_out, CONN, "copy c to stdout", function () error ("stop") end))
+	assert2 (false, pcall (CONN.copy_out, CONN, "copy c to stdout", function () error () end))
+	assert2 (false, pcall (CONN.copy_out, CONN, "copy c to stdout", function ()
+		CONN:execute ("select 1")
+	end))
+	assert2 (7, CONN:copy_out ("copy c to stdout", function () end), "connection unusable after an error")
+	assert (CONN:execute ("drop table c"))
+	io.write (" copy")
+end
+
+table.insert (CONN_METHODS, "copy_in")
+table.insert (CONN_METHODS, "copy_out")
+table.insert (EXTENSIONS, copy)
@@ -23,3 +23,824 @@ end
 
 table.insert (CONN_METHODS, "escape")
 table.insert (EXTENSIONS, escape)
+
+---------------------------------------------------------------------
+-- Prepared statements
+---------------------------------------------------------------------
+function prepare ()
+	local ins = assert (CONN:prepare ("insert into t (f1, f2) values (?, :f2)"))
+	assert2 (1, ins:execute ("a", "b"))
+	assert2 (1, ins:execute { "c", f2 = "d" })
+	assert2 (true, ins:bind ("e"))
+	assert2 (1, ins:execute ())
+	assert2 (true, ins:close ())
+	assert2 (false, ins:close ())
+
+	local sel = assert (CONN:prepare ("select f1, f2 from t where f1 = ?"))
+	local cur = CUR_OK (sel:execute ("a"))
+	assert2 (false, pcall (sel.execute, sel, "c"), "statement executed with an open cursor")
+	local f1, f2 = cur:fetch ()
+	assert2 ("a", f1)
+	assert2 ("b", f2)
+	assert2 (nil, cur:fetch ())
+	cur = CUR_OK (sel:execute ("c"))
+	f1, f2 = cur:fetch ()
+	assert2 ("d", f2)
+	assert2 (true, cur:close ())
+	cur = CUR_OK (sel:execute ("e"))
+	f1, f2 = cur:fetch ()
+	assert2 ("e", f1)
+	assert2 (nil, f2)
+	assert2 (true, cur:close ())
+	assert2 (true, sel:close ())
+
+	assert2 (3, CONN:execute ("delete from t where f1 in ('a', 'c', 'e')"))
+	io.write (" prepare")
+end
+
+table.insert (CONN_METHODS, "prepare")
+table.insert (EXTENSIONS, prepare)
+
+---------------------------------------------------------------------
+-- Statement cache of conn:execute
+---------------------------------------------------------------------
+function statement_cache ()
+	assert2 (true, CONN:setcachesize (2))
+	local stats = CONN:cachestats ()
+	assert2 (2, stats.capacity)
+	local hits, misses = stats.hits, stats.misses
+
+	for i = 1, 3 do
+		assert2 (0, CONN:execute ("delete from t where f1 = 'x'"))
+	end
+	stats = CONN:cachestats ()
+	assert2 (misses + 1, stats.misses)
+	assert2 (hits + 2, stats.hits)
+
+	-- a statement in use by a cursor is not shared
+	local evictions = CONN:cachestats ().evictions
+	local cur1 = CUR_OK (CONN:execute ("select count(*) from t"))
+	local cur2 = CUR_OK (CONN:execute ("select count(*) from t"))
+	assert2 (0, tonumber (cur1:fetch ()))
+	assert2 (0, tonumber (cur2:fetch ()))
+	assert2 (true, cur1:close ())
+	assert2 (true, cur2:close ())
+	-- the second copy is dropped instead of evicting another statement
+	stats = CONN:cachestats ()
+	assert2 (2, stats.size)
+	assert2 (evictions, stats.evictions, "duplicate statement cached")
+
+	-- the least recently used statements are evicted
+	assert2 (0, CONN:execute ("delete from t where f1 = 'y'"))
+	assert2 (0, CONN:execute ("delete from t where f1 = 'z'"))
+	stats = CONN:cachestats ()
+	assert2 (2, stats.size)
+	assert (stats.evictions > evictions, "cache was not trimmed")
+
+	assert2 (true, CONN:setcachesize (0))
+	assert2 (0, CONN:cachestats ().size)
+	assert2 (0, CONN:execute ("delete from t where f1 = 'x'"))
+	assert2 (0, CONN:cachestats ().size)
+	assert2 (true, CONN:setcachesize (64))
+	io.write (" statement_cache")
+end
+
+table.insert (CONN_METHODS, "setcachesize")
+table.insert (CONN_METHODS, "cachestats")
+table.insert (EXTENSIONS, statement_cache)
+
+---------------------------------------------------------------------
+-- The first row of a query is not computed twice
+---------------------------------------------------------------------
+function first_row ()
+	-- RETURNING is only available since SQLite 3.35
+	local cur = CONN:execute ("insert into t (f1) values ('r') returning f1")
+	if cur then
+		assert2 ('r', cur:fetch ())
+		assert2 (nil, cur:fetch ())
+		cur = CUR_OK (CONN:execute ("select count(*) from t where f1 = 'r'"))
+		assert2 (1, tonumber (cur:fetch ()), "statement executed twice")
+		assert2 (true, cur:close ())
+		assert2 (1, CONN:execute ("delete from t where f1 = 'r'"))
+	end
+	-- a query without rows
+	cur = CUR_OK (CONN:execute ("select f1 from t where f1 = 'r'"))
+	assert2 (nil, cur:fetch ())
+	assert2 (false, cur:close (), MSG_CURSOR_NOT_CLOSED)
+	io.write (" first_row")
+end
+
+table.insert (EXTENSIONS, first_row)
+
+---------------------------------------------------------------------
+-- Bulk retrieval of rows
+---------------------------------------------------------------------
+function fetch_bulk ()
+	for i = 1, 5 do
+		assert2 (1, CONN:execute ("insert into t (f1, f2) values ('"..i.."', 'v"..i.."')"))
+	end
+	local cur = CUR_OK (CONN:execute ("select f1, f2 from t order by f1"))
+	local rows = cur:fetchmany (2)
+	assert2 (2, #rows)
+	assert2 ('1', rows[1][1])
+	assert2 ('v2', rows[2][2])
+	assert2 (nil, rows[1].f1)
+	rows = cur:fetchmany (2, "a")
+	assert2 (2, #rows)
+	assert2 ('3', rows[1].f1)
+	assert2 (nil, rows[1][1])
+	rows = cur:fetchmany (2, "an")
+	assert2 (1, #rows)
+	assert2 ('5', rows[1][1])
+	assert2 ('v5', rows[1].f2)
+	assert2 (false, cur:close (), MSG_CURSOR_NOT_CLOSED)
+
+	cur = CUR_OK (CONN:execute ("select f1, f2 from t order by f1"))
+	assert2 (false, pcall (cur.fetchmany, cur, 0), "zero rows accepted")
+	assert2 (false, pcall (cur.fetchmany, cur, 1.5), "fractional count accepted")
+	assert2 (false, pcall (cur.fetchmany, cur, 2^40), "huge count accepted")
+	assert2 ('1', cur:fetch ())
+	rows = cur:fetchall ()
+	assert2 (4, #rows)
+	assert2 ('2', rows[1][1])
+	assert2 ('v5', rows[4][2])
+	assert2 (false, cur:close (), MSG_CURSOR_NOT_CLOSED)
+
+	cur = CUR_OK (CONN:execute ("select f1 from t where f1 = 'none'"))
+	assert2 (0, #cur:fetchall ("a"))
+	assert2 (false, cur:close (), MSG_CURSOR_NOT_CLOSED)
+
+	assert2 (5, CONN:execute ("delete from t where f1 in ('1', '2', '3', '4', '5')"))
+	io.write (" fetch_bulk")
+end
+
+table.insert (CUR_METHODS, "fetchmany")
+table.insert (CUR_METHODS, "fetchall")
+table.insert (EXTENSIONS, fetch_bulk)
+
+---------------------------------------------------------------------
+-- Connection options
+---------------------------------------------------------------------
+local function pragma (conn, name)
+	local cur = CUR_OK (conn:execute ("pragma "..name))
+	local value = cur:fetch ()
+	cur:close ()
+	return value
+end
+
+function connect_options ()
+	local path = datasource.."-options"
+	local conn = CONN_OK (ENV:connect (path, {
+		journal_mode = "wal",
+		synchronous = "normal",
+		cache_size = -4096,
+		temp_store = "memory",
+		foreign_keys = true,
+		timeout = 1000,
+		statement_cache = 8,
+	}))
+	assert2 ("wal", pragma (conn, "journal_mode"))
+	assert2 (1, tonumber (pragma (conn, "synchronous")))
+	assert2 (-4096, tonumber (pragma (conn, "cache_size")))
+	assert2 (2, tonumber (pragma (conn, "temp_store")))
+	assert2 (1, tonumber (pragma (conn, "foreign_keys")))
+	assert2 (8, conn:cachestats ().capacity)
+	assert2 (true, conn:close ())
+
+	conn = CONN_OK (ENV:connect (path, { readonly = true }))
+	assert2 (nil, conn:execute ("create table x (c text)"), "read only connection")
+	assert2 (true, conn:close ())
+
+	assert2 (nil, ENV:connect (path, { journal_mode = {} }), "invalid option")
+	os.remove (path)
+	io.write (" connect_options")
+end
+
+table.insert (EXTENSIONS, connect_options)
+
+---------------------------------------------------------------------
+-- Incremental BLOB I/O
+---------------------------------------------------------------------
+function blob ()
+	local size = 20000
+	-- sqlite3_changes is not reset by DDL statements
+	assert (CONN:execute ("create table b (id integer primary key, data blob)"))
+	assert2 (1, CONN:execute ("insert into b (id, data) values (1, zeroblob("..size.."))"))
+
+	local h = assert (CONN:openblob ("b", "data", 1, true))
+	assert2 (size, h:size ())
+	local chunk = string.rep ("x", 7000)
+	for i = 1, 2 do
+		assert2 (true, h:write (chunk))
+	end
+	assert2 (nil, h:write (chunk), "blob should not grow")
+	assert2 (true, h:write ("end", size - 3))
+	assert2 (chunk, h:read (7000, 0))
+	assert2 (chunk, h:read (7000))
+	local rest = h:read (size)
+	assert2 (size - 14000, #rest)
+	assert2 ("end", rest:sub (-3))
+	assert2 (nil, h:read (10))
+	assert2 (false, pcall (CONN.close, CONN), "connection closed with an open blob")
+	assert2 (true, h:close ())
+	assert2 (false, h:close ())
+
+	h = assert (CONN:openblob ("b", "data", 1))
+	assert2 (nil, h:write ("y"), "read only blob")
+	assert2 (true, h:close ())
+	assert2 (nil, CONN:openblob ("b", "data", 2), "row does not exist")
+	if math.type then
+		-- rowids above 2^53 are not rounded
+		local big = 9007199254740993
+		assert2 (1, CONN:execute ("insert into b (id, data) values ("..big..", x'01')"))
+		assert2 (nil, CONN:openblob ("b", "data", big - 1), "rowid rounded")
+		h = assert (CONN:openblob ("b", "data", big))
+		assert2 ("\1", h:read (1))
+		assert2 (true, h:close ())
+	end
+
+	assert (CONN:execute ("drop table b"))
+	io.write (" blob")
+end
+
+table.insert (CONN_METHODS, "openblob")
+table.insert (EXTENSIONS, blob)
+
+---------------------------------------------------------------------
+-- Group commit
+---------------------------------------------------------------------
+local function count_rows (conn, where)
+	local cur = CUR_OK (conn:execute ("select count(*) from t where "..where))
+	local n = tonumber (cur:fetch ())
+	cur:close ()
+	return n
+end
+
+function group_commit ()
+	local other = CONN_OK (ENV:connect (datasource))
+	assert2 (true, CONN:setgroupcommit { statements = 3, interval = 60000 })
+	assert2 (1, CONN:execute ("insert into t (f1) values ('g1')"))
+	assert2 (1, CONN:execute ("insert into t (f1) values ('g2')"))
+	local stats = CONN:groupstats ()
+	assert2 (2, stats.pending)
+	assert2 (0, stats.flushes)
+	assert2 (2, count_rows (CONN, "f1 like 'g%'"))
+	assert2 (0, count_rows (other, "f1 like 'g%'"), "batch committed too early")
+
+	assert2 (1, CONN:execute ("insert into t (f1) values ('g3')"))
+	stats = CONN:groupstats ()
+	assert2 (0, stats.pending)
+	assert2 (1, stats.flushes)
+	assert2 (3, stats.largest)
+	assert2 (3, count_rows (other, "f1 like 'g%'"))
+
+	assert2 (3, CONN:execute ("delete from t where f1 like 'g%'"))
+	assert2 (1, CONN:groupstats ().pending)
+	assert2 (true, CONN:flush ())
+	assert2 (0, count_rows (other, "f1 like 'g%'"))
+	assert2 (2, CONN:groupstats ().flushes)
+
+	assert2 (true, CONN:setgroupcommit (false))
+	assert2 (true, other:close ())
+	io.write (" group_commit")
+end
+
+table.insert (CONN_METHODS, "setgroupcommit")
+table.insert (CONN_METHODS, "flush")
+table.insert (CONN_METHODS, "groupstats")
+table.insert (EXTENSIONS, group_commit)
+
+---------------------------------------------------------------------
+-- Pool of readers with a single writer
+---------------------------------------------------------------------
+local function count_all (conn)
+	local cur = CUR_OK (conn:execute ("select count(*) from p"))
+	local n = tonumber (cur:fetch ())
+	cur:close ()
+	return n
+end
+
+function pool ()
+	local path = datasource.."-pool"
+	local p = assert (ENV:connectpool (path, { readers = 2, timeout = 1000 }))
+	assert2 ("wal", pragma (p:writer (), "journal_mode"))
+	assert (p:execute ("create table p (id integer primary key, v text)"))
+	assert2 (1, p:execute ("insert into p (v) values ('a')"))
+	-- writes are compiled only by the writer once they are known
+	assert2 (1, p:execute ("insert into p (v) values ('a')"))
+	assert2 (1, p:execute ("delete from p where id = 2"))
+	for i = 1, 2 do
+		local s = p:reader ():cachestats ()
+		assert2 (0, s.size, "write kept by a reader")
+		assert2 (0, s.hits + s.misses, "write looked up by a reader")
+	end
+
+	local cur = CUR_OK (p:execute ("select v from p"))
+	assert2 ("a", cur:fetch ())
+	-- readers are not blocked by a writer transaction
+	local w = p:writer ()
+	assert2 (true, w:setautocommit (false))
+	assert2 (1, w:execute ("insert into p (v) values ('b')"))
+	assert2 (2, count_all (p), "statements in a transaction go to the writer")
+	assert2 (1, count_all (p:reader ()))
+	assert2 (true, w:commit ())
+	assert2 (true, w:setautocommit (true))
+	assert2 (nil, p:reader ():execute ("delete from p"), "read only connection")
+	assert2 (false, pcall (p.close, p), "pool closed with an open cursor")
+	assert2 (true, cur:close ())
+
+	local stats = p:stats ()
+	assert2 (2, stats.readers)
+	assert2 (1, stats.reads)
+	assert2 (5, stats.writes)
+
+	-- the flags option does not make the readers writable
+	local f = assert (ENV:connectpool (path, { readers = 1, flags = 6 }))
+	assert2 (nil, f:reader ():execute ("delete from p"), "read only connection")
+	assert2 (true, f:close ())
+
+	-- queries see the writes of an open group commit batch
+	local g = assert (ENV:connectpool (path, { readers = 1,
+		group_commit = { statements = 100, interval = 60000 } }))
+	assert2 (1, g:execute ("insert into p (v) values ('c')"))
+	assert2 (3, count_all (g), "batched write not seen by the pool")
+	assert2 (true, g:close ())
+	g = assert (ENV:connectpool (path, { readers = 1,
+		group_commit = { statements = 100, interval = 60000, flushonread = true } }))
+	assert2 (1, g:execute ("insert into p (v) values ('d')"))
+	assert2 (4, count_all (g), "batch not flushed before a read")
+	assert2 (1, g:stats ().reads)
+	assert2 (true, g:close ())
+	local st = p:reader ():prepare ("select count(*) from p")
+	assert2 (false, pcall (p.close, p), "pool closed with an open statement")
+	assert2 (true, st:close ())
+	local b = assert (p:writer ():openblob ("p", "v", 1))
+	assert2 (false, pcall (p.close, p), "pool closed with an open blob")
+	assert2 (true, b:close ())
+	assert2 (true, p:close ())
+	assert2 (false, p:close ())
+	assert2 (nil, ENV:connectpool (path, { journal_mode = {} }), "invalid option")
+	os.remove (path)
+	os.remove (path.."-wal")
+	os.remove (path.."-shm")
+	io.write (" pool")
+end
+
+table.insert (ENV_METHODS, "connectpool")
+table.insert (EXTENSIONS, pool)
+
+---------------------------------------------------------------------
+-- Backup and serialization
+---------------------------------------------------------------------
+local function count_t (conn)
+	local cur = CUR_OK (conn:execute ("select count(*) from t"))
+	local n = tonumber (cur:fetch ())
+	cur:close ()
+	return n
+end
+
+function backup ()
+	local rows = count_t (CONN)
+	local mem = CONN_OK (ENV:connect (":memory:"))
+	assert2 (true, CONN:backup_to (mem, 1))
+	assert2 (rows, count_t (mem))
+
+	local path = datasource.."-backup"
+	assert2 (true, mem:backup_to (path))
+	local copy = CONN_OK (ENV:connect (path))
+	assert2 (rows, count_t (copy))
+	-- a locked destination is not waited for beyond the timeout
+	assert (copy:execute ("begin exclusive"))
+	assert2 (nil, mem:backup_to (path, -1, "main", 50), "backup to a locked database")
+	assert (copy:execute ("rollback"))
+	assert2 (true, copy:close ())
+	os.remove (path)
+
+	if CONN.serialize then
+		local bytes = CONN:serialize ()
+		assert2 ("SQLite format 3\0", bytes:sub (1, 16))
+		local other = CONN_OK (ENV:connect (":memory:"))
+		assert2 (true, other:deserialize (bytes))
+		assert2 (rows, count_t (other))
+		assert2 (1, other:execute ("insert into t (f1) values ('s')"))
+		assert2 (rows + 1, count_t (other))
+		assert2 (true, other:deserialize (bytes, "main", true))
+		assert2 (nil, other:execute ("delete from t"), "read only database")
+		assert2 (true, other:close ())
+	end
+	assert2 (true, mem:close ())
+	io.write (" backup")
+end
+
+table.insert (CONN_METHODS, "backup_to")
+table.insert (EXTENSIONS, backup)
+
+---------------------------------------------------------------------
+-- Statement counters and profiling
+---------------------------------------------------------------------
+function profile ()
+	assert (CONN:execute ("create table s (a integer, b integer)"))
+	for i = 1, 5 do
+		assert2 (1, CONN:execute ("insert into s values ("..i..", "..(-i)..")"))
+	end
+	local cur = CUR_OK (CONN:execute ("select a from s order by b"))
+	while cur:fetch () do end
+	local stats = cur:stats ()
+	assert2 (1, stats.sort)
+	assert2 (true, stats.fullscan > 0, "full scan not counted")
+	-- a cached statement counts each of its queries apart
+	cur = CUR_OK (CONN:execute ("select a from s order by b"))
+	while cur:fetch () do end
+	assert2 (stats.vmstep, cur:stats ().vmstep)
+	assert2 (1, cur:stats ().sort)
+	assert (CONN:execute ("drop table s"))
+
+	if CONN.setprofile then
+		assert2 (true, CONN:setprofile (2))
+		for i = 1, 3 do
+			assert (CONN:execute ("update t set f1 = f1 where f1 = 'p"..i.."'"))
+		end
+		local list = CONN:getprofile ()
+		assert2 (2, #list)
+		assert2 ("update t set f1 = f1 where f1 = 'p2'", list[1].sql)
+		assert2 ("update t set f1 = f1 where f1 = 'p3'", list[2].sql)
+		assert2 ("number", type (list[2].time))
+
+		local seen = {}
+		assert2 (true, CONN:setprofile (function (sql, ns)
+			table.insert (seen, sql)
+		end))
+		assert (CONN:execute ("update t set f1 = f1 where f1 = 'p4'"))
+		assert2 ("update t set f1 = f1 where f1 = 'p4'", seen[1])
+		assert2 (true, CONN:setprofile (false))
+		assert (CONN:execute ("update t set f1 = f1 where f1 = 'p5'"))
+		assert2 (1, #seen)
+		assert2 (0, #CONN:getprofile ())
+	end
+	io.write (" profile")
+end
+
+table.insert (CUR_METHODS, "stats")
+table.insert (EXTENSIONS, profile)
+
+---------------------------------------------------------------------
+-- Busy handler
+---------------------------------------------------------------------
+function busy_handler ()
+	local other = CONN_OK (ENV:connect (datasource))
+	assert (other:execute ("begin exclusive"))
+	assert2 (true, CONN:setbusyhandler { timeout = 50, min = 2, max = 20 })
+	assert2 (nil, CONN:execute ("insert into t (f1) values ('busy')"), "database should be locked")
+	local stats = CONN:busystats ()
+	assert2 (1, stats.events)
+	assert2 (1, stats.failures)
+	assert2 (true, stats.retries > 0, "no retries")
+	assert2 (true, stats.waited > 0, "no time waited")
+	assert (other:execute ("rollback"))
+
+	assert2 (1, CONN:execute ("insert into t (f1) values ('busy')"))
+	assert2 (1, CONN:execute ("delete from t where f1 = 'busy'"))
+	assert2 (1, CONN:busystats ().events)
+	assert2 (true, CONN:setbusyhandler (false))
+	assert2 (true, other:close ())
+	io.write (" busy_handler")
+end
+
+table.insert (CONN_METHODS, "setbusyhandler")
+table.insert (CONN_METHODS, "busystats")
+table.insert (EXTENSIONS, busy_handler)
+
+---------------------------------------------------------------------
+-- Transaction modes
+---------------------------------------------------------------------
+function transaction_mode ()
+	local other = CONN_OK (ENV:connect (datasource, { transaction_mode = "immediate" }))
+	assert2 (true, CONN:setbusyhandler (false))
+	-- a deferred transaction takes no lock until it is used
+	assert2 (true, other:settransactionmode ("deferred"))
+	assert2 (true, other:setautocommit (false))
+	assert2 (1, CONN:execute ("insert into t (f1) values ('tx')"))
+	assert2 (true, other:rollback ())
+	-- an immediate one takes the write lock when it begins
+	assert2 (true, other:settransactionmode ("immediate"))
+	assert2 (true, other:rollback ())
+	assert2 (nil, CONN:execute ("delete from t where f1 = 'tx'"), "database should be locked")
+	assert2 (true, other:commit ())
+	assert2 (true, other:setautocommit (true))
+	assert2 (1, CONN:execute ("delete from t where f1 = 'tx'"))
+	assert2 (false, pcall (other.settransactionmode, other, "lazy"))
+	assert2 (false, pcall (ENV.connect, ENV, datasource, { transaction_mode = "lazy" }))
+	assert2 (true, other:close ())
+	io.write (" transaction_mode")
+end
+
+table.insert (CONN_METHODS, "settransactionmode")
+table.insert (EXTENSIONS, transaction_mode)
+
+---------------------------------------------------------------------
+-- Query timeout and interruption
+---------------------------------------------------------------------
+local ENDLESS = "with recursive c(x) as (select 1 union all select x + 1 from c) "
+
+function query_timeout ()
+	assert2 (true, CONN:setquerytimeout (50))
+	local res, err = CONN:execute (ENDLESS.."select count(*) from c")
+	assert2 (nil, res)
+	assert2 ("LuaSQL: query timed out", err)
+
+	-- the deadline covers the fetches of a cursor
+	local cur = CUR_OK (CONN:execute (ENDLESS.."select x from c"))
+	local row
+	repeat
+		row, err = cur:fetch ()
+	until not row
+	assert2 ("LuaSQL: query timed out", err)
+
+	assert2 (true, CONN:setquerytimeout (0))
+	cur = CUR_OK (CONN:execute (ENDLESS.."select x from c"))
+	assert2 (1, cur:fetch ())
+	assert2 (true, CONN:interrupt ())
+	row, err = cur:fetch ()
+	assert2 (nil, row)
+	assert2 (true, err:find ("interrupt") ~= nil, "cursor was not interrupted")
+	assert2 (1, CONN:execute ("insert into t (f1) values ('it')"))
+	assert2 (1, CONN:execute ("delete from t where f1 = 'it'"))
+	io.write (" query_timeout")
+end
+
+table.insert (CONN_METHODS, "setquerytimeout")
+table.insert (CONN_METHODS, "interrupt")
+table.insert (EXTENSIONS, query_timeout)
+
+---------------------------------------------------------------------
+-- SQL functions implemented in Lua
+---------------------------------------------------------------------
+function functions ()
+	assert2 (true, CONN:create_function ("score", 2, function (a, b)
+		return a * 10 + b
+	end, { deterministic = true }))
+	assert2 (true, CONN:create_function ("fails", 0, function ()
+		error ("no way")
+	end))
+	assert2 (true, CONN:create_aggregate ("concat", function (state, s)
+		return (state and state.."," or "")..s
+	end, function (state)
+		return state or "none"
+	end, { nargs = 1 }))
+
+	assert (CONN:execute ("create table fn (a integer, b integer, s text)"))
+	for i = 1, 4 do
+		assert2 (1, CONN:execute (string.format ("insert into fn values (%d, %d, 'r%d')", i, i % 2, i)))
+	end
+	local cur = CUR_OK (CONN:execute ("select a from fn where score (a, b) > 30 order by a"))
+	assert2 (3, cur:fetch ())
+	assert2 (4, cur:fetch ())
+	assert2 (nil, cur:fetch ())
+
+	cur = CUR_OK (CONN:execute ("select b, concat (s) from fn group by b order by b"))
+	local b, s = cur:fetch ()
+	assert2 (0, b)
+	assert2 ("r2,r4", s)
+	b, s = cur:fetch ()
+	assert2 ("r1,r3", s)
+	cur:close ()
+
+	cur = CUR_OK (CONN:execute ("select concat (s), score (1.5, 1) from fn where a > 10"))
+	local none, score = cur:fetch ()
+	assert2 ("none", none)
+	assert2 (16, score)
+	cur:close ()
+
+	local res, err = CONN:execute ("select fails ()")
+	assert2 (nil, res)
+	assert2 (true, err:find ("no way") ~= nil, "error message not propagated")
+	assert2 (nil, CONN:execute ("select score (1)"), "wrong number of arguments")
+	assert (CONN:execute ("drop table fn"))
+	io.write (" functions")
+end
+
+table.insert (CONN_METHODS, "create_function")
+table.insert (CONN_METHODS, "create_aggregate")
+table.insert (EXTENSIONS, functions)
+
+---------------------------------------------------------------------
+-- SQL scripts
+---------------------------------------------------------------------
+function execscript ()
+	assert2 (3, CONN:execscript ([[
+		create table sc (id integer primary key, v text);
+		-- seed data
+		insert into sc (v) values ('a');
+		insert into sc (v) values ('b'), ('c');
+		select * from sc;
+	]]))
+	local good = "insert into sc (v) values ('d'); "
+	local res, err, pos = CONN:execscript (good.."insert into nothing values (1);", { transaction = true })
+	assert2 (nil, res)
+	assert2 (true, err:find ("nothing") ~= nil, "wrong error message")
+	assert2 (#good + 1, pos)
+	local cur = CUR_OK (CONN:execute ("select count(*) from sc"))
+	assert2 (3, tonumber (cur:fetch ()), "script was not rolled back")
+	cur:close ()
+
+	-- inside a transaction, only the script is rolled back
+	assert2 (true, CONN:setautocommit (false))
+	assert2 (1, CONN:execute ("delete from sc where v = 'a'"))
+	assert2 (nil, CONN:execscript ("delete from sc; select nothing", { transaction = true }))
+	cur = CUR_OK (CONN:execute ("select count(*) from sc"))
+	assert2 (2, tonumber (cur:fetch ()))
+	cur:close ()
+	assert2 (true, CONN:commit ())
+	assert2 (true, CONN:setautocommit (true))
+	assert2 (2, CONN:execscript ("delete from sc; drop table sc;"))
+	assert2 (0, CONN:execscript (" -- nothing \n"))
+	io.write (" execscript")
+end
+
+table.insert (CONN_METHODS, "execscript")
+table.insert (EXTENSIONS, execscript)
+
+---------------------------------------------------------------------
+-- Bulk execution
+---------------------------------------------------------------------
+function executemany ()
+	assert (CONN:execute ("create table bulk (id integer primary key, v text)"))
+	local rows = {}
+	for i = 1, 100 do
+		rows[i] = { i, "v"..i }
+	end
+	assert2 (100, CONN:executemany ("insert into bulk values (?, ?)", rows, { transaction = true }))
+
+	local i = 0
+	assert2 (3, CONN:executemany ("insert into bulk values (:id, :v)", function ()
+		i = i + 1
+		if i <= 3 then
+			return { id = 100 + i, v = "named" }
+		end
+	end))
+	assert2 (2, CONN:executemany ("delete from bulk where id = ?", { 101, 102 }))
+
+	local res, err, n = CONN:executemany ("insert into bulk values (?, ?)",
+		{ { 300, "a" }, { 300, "b" } }, { transaction = true })
+	assert2 (nil, res, "duplicate key accepted")
+	assert2 (2, n)
+	assert2 (false, pcall (CONN.executemany, CONN, "insert into bulk values (?, ?)",
+		{ { 1, "a" }, { 2, {} } }, { transaction = true }))
+	assert2 (nil, CONN:executemany ("insert into nothing values (?)", { 1 }))
+
+	local cur = CUR_OK (CONN:execute ("select count(*) from bulk"))
+	assert2 (101, tonumber (cur:fetch ()))
+	cur:close ()
+	assert (CONN:execute ("drop table bulk"))
+	io.write (" executemany")
+end
+
+table.insert (CONN_METHODS, "executemany")
+table.insert (EXTENSIONS, executemany)
+
+---------------------------------------------------------------------
+-- Shared column information
+---------------------------------------------------------------------
+local function colnames (sql)
+	local cur = CUR_OK (CONN:execute (sql))
+	local names = cur:getcolnames ()
+	cur:close ()
+	return names
+end
+
+function column_info ()
+	assert (CONN:execute ("create table ci (a integer, b text)"))
+	local names = colnames ("select * from ci")
+	assert2 (2, #names)
+	assert2 ("b", names[2])
+	names[2] = "x"
+	assert2 ("b", colnames ("select * from ci")[2], "cached names were modified")
+	assert (CONN:execute ("alter table ci add column c real"))
+	local cur = CUR_OK (CONN:execute ("select * from ci"))
+	-- the statement is compiled again by its first step
+	assert2 (3, #cur:getcolnames ())
+	assert2 ("REAL", cur:getcoltypes ()[3])
+	cur:close ()
+	assert (CONN:execute ("drop table ci"))
+	io.write (" column_info")
+end
+
+table.insert (EXTENSIONS, column_info)
+
+---------------------------------------------------------------------
+-- Memory statistics and heap limits
+---------------------------------------------------------------------
+function memory ()
+	local mem = ENV:memstats ()
+	assert2 ("number", type (mem.memory_used))
+	assert (mem.memory_used_highwater >= mem.memory_used)
+	local db = CONN:dbstatus ()
+	assert2 ("number", type (db.cache_used))
+	assert2 ("number", type (db.schema_used))
+
+	local old = ENV:softheaplimit (8 * 1024 * 1024)
+	assert2 (8 * 1024 * 1024, ENV:softheaplimit ())
+	ENV:softheaplimit (old)
+	assert2 (old, ENV:softheaplimit ())
+	io.write (" memory")
+end
+
+table.insert (ENV_METHODS, "memstats")
+table.insert (ENV_METHODS, "softheaplimit")
+table.insert (CONN_METHODS, "dbstatus")
+table.insert (EXTENSIONS, memory)
+
+---------------------------------------------------------------------
+-- Checkpoints and maintenance
+---------------------------------------------------------------------
+function maintenance ()
+	local path = datasource.."-checkpoint"
+	local conn = CONN_OK (ENV:connect (path, {
+		journal_mode = "wal",
+		wal_autocheckpoint = 0,
+	}))
+	assert2 (0, tonumber (pragma (conn, "wal_autocheckpoint")))
+	assert (conn:execute ("create table m (v text)"))
+	for i = 1, 20 do
+		assert (conn:execute ("insert into m values ('"..i.."')"))
+	end
+	local log, done = conn:checkpoint ("full")
+	assert (log > 0, "the log should have frames")
+	assert2 (log, done)
+	assert2 (false, pcall (conn.checkpoint, conn, "sometimes"))
+	assert2 (true, conn:setautocheckpoint (100))
+	assert2 (100, tonumber (pragma (conn, "wal_autocheckpoint")))
+	assert2 (true, conn:optimize ())
+	assert2 (true, conn:optimize (10))
+	assert2 (true, conn:close ())
+	os.remove (path)
+	os.remove (path.."-wal")
+	os.remove (path.."-shm")
+	io.write (" maintenance")
+end
+
+table.insert (CONN_METHODS, "checkpoint")
+table.insert (CONN_METHODS, "setautocheckpoint")
+table.insert (CONN_METHODS, "optimize")
+table.insert (EXTENSIONS, maintenance)
+
+---------------------------------------------------------------------
+-- Data change hooks
+---------------------------------------------------------------------
+function hooks ()
+	assert (CONN:execute ("create table h (id integer primary key, v text)"))
+	local rows = {}
+	assert2 (true, CONN:on_update (function (op, db, tab, rowid)
+		rows[#rows+1] = op..":"..db.."."..tab..":"..rowid
+	end))
+	assert (CONN:execute ("insert into h values (1, 'a')"))
+	assert (CONN:execute ("update h set v = 'b' where id = 1"))
+	assert2 ("insert:main.h:1", rows[1])
+	assert2 ("update:main.h:1", rows[2])
+
+	local batches = {}
+	assert2 (true, CONN:on_update (function (changes)
+		batches[#batches+1] = changes
+	end, { buffered = true }))
+	local commits, rollbacks = 0, 0
+	assert2 (true, CONN:on_commit (function () commits = commits + 1 end))
+	assert2 (true, CONN:on_rollback (function () rollbacks = rollbacks + 1 end))
+	CONN:setautocommit (false)
+	assert (CONN:execute ("insert into h values (2, 'c')"))
+	assert (CONN:execute ("delete from h where id = 1"))
+	assert2 (0, #batches, "changes delivered before commit")
+	assert2 (true, CONN:commit ())
+	assert2 (1, #batches)
+	assert2 (2, #batches[1])
+	assert2 ("insert", batches[1][1].op)
+	assert2 ("h", batches[1][1].table)
+	assert2 (2, batches[1][1].rowid)
+	assert2 ("delete", batches[1][2].op)
+	assert (CONN:execute ("insert into h values (3, 'd')"))
+	assert2 (true, CONN:rollback ())
+	assert2 (1, #batches, "rolled back changes delivered")
+	CONN:setautocommit (true)
+	assert (commits >= 1)
+	assert (rollbacks >= 1)
+
+	assert2 (true, CONN:on_update (function (changes)
+		batches[#batches+1] = changes
+	end, { buffered = true, limit = 1 }))
+	assert (CONN:execute ("insert into h values (5, 'x')"))
+	assert2 (nil, batches[#batches].overflow)
+	assert (CONN:execute ("insert into h select id + 10, v from h"))
+	assert2 (true, batches[#batches].overflow)
+
+	assert2 (true, CONN:on_commit (function () return true end))
+	assert2 (nil, CONN:execute ("insert into h values (4, 'e')"), "commit not vetoed")
+	assert2 (true, CONN:on_commit (false))
+	assert2 (true, CONN:on_rollback (false))
+	assert2 (true, CONN:on_update (false))
+	assert (CONN:execute ("drop table h"))
+	io.write (" hooks")
+end
+
+table.insert (CONN_METHODS, "on_update")
+table.insert (CONN_METHODS, "on_commit")
+table.insert (CONN_METHODS, "on_rollback")
+table.insert (EXTENSIONS, hooks)